@@ -4,6 +4,7 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <math.h>
 #include <getopt.h>
@@ -11,6 +12,13 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 #include <cairo.h>
 #include <cairo-pdf.h>
@@ -18,23 +26,45 @@
 #include <poppler.h>
 #include <pango/pangocairo.h>
 
+#include "bookmaker.h"
+
 #define VERSION "0.3a"
 
 // toggle to display boxes for debugging
 //#define DISPLAY_BOXES
 
-#define NOT_IMPLEMENTED() printf("NOT_IMPLEMENTED %s:%d\n", __FILE__, __LINE__); exit(1);
+#define NOT_IMPLEMENTED() fail("NOT_IMPLEMENTED %s:%d", __FILE__, __LINE__);
+
+// errors end the program, or the library job running on this thread, or
+// the thread started by a job once the job raises them
+void fail(const char *format, ...) __attribute__ ((noreturn, format (printf, 1, 2)));
+void fail_with_error(char *error) __attribute__ ((noreturn));
+
+struct failure_t {
+	jmp_buf failed; // where fail jumps to on the thread
+	char *error; // set by fail, NULL until then
+};
+void catch_failures(struct failure_t *failure);
+void raise_failure(char *error);
+// status messages go to stdout, library jobs do not print them
+void message(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
 
 enum paper_t {a4, letter};
 enum type_t {chapbook, perfect};
 enum trim_t {even_odd, document, per_page};
+enum engine_t {render, xobject};
+enum sync_t {sync_none, sync_end, sync_chunks};
+enum color_t {color_keep, color_gray, color_bitonal};
 struct options_t {
 	char *executable_name;
 	char *input_filename;
+	const unsigned char *input_data; // the input when it was not read from input_filename
+	size_t input_length;
 	char *output_filename;
 	enum paper_t paper;
 	enum type_t type;
 	enum trim_t trim;
+	enum engine_t engine;
 	int print_page_numbers;
 	int print;
 	char* printer;
@@ -44,37 +74,443 @@ struct options_t {
 	char* title;
 	char* date;
 	char* author;
+	int progress_fd;
+	int dedup;
+	int fast_trim;
+	int trim_sample; // pages drawn per crop box, 0 draws every page
+	int passthrough;
+	int split; // sheets per output file, 0 writes one file
+	int threads; // drawing pages, 1 draws them on the main thread
+	size_t max_memory; // bytes, 0 for no limit
+	int watch; // make the book again whenever the input changes
+	int write_buffers; // of the writer thread, 0 writes on the layout thread
+	enum sync_t sync; // of the output file
+	int deterministic; // the same input and options make the same bytes
+	int verify; // compare the book to one made without the fast paths
+	int pipeline; // trim per page while laying out
+	enum color_t color; // of scanned pages
 };
 
+struct options_t default_options(char *executable_name);
+int find_option(const char *name, int *has_value);
+char* set_option(struct options_t *options, int option, char *value);
+char* check_options(struct options_t *options);
 struct options_t parse_options(int, char**);
 void print_options(struct options_t);
 
 struct page_t {
 	int num;
-	cairo_rectangle_t *crop_box;
+	int crop_box; // index into pages_t crop_boxes, -1 until trimmed
+	cairo_rectangle_t ink_extents; // of this page alone, valid if has_ink_extents
+	int has_ink_extents;
+};
+
+struct pool_entry_t {
+	PopplerPage *page; // NULL when not loaded
+	cairo_surface_t *recording; // NULL when not recorded
+	int refs;
+	int prev, next; // lru list of loaded pages without references
+};
+
+#define PAGE_POOL_CAPACITY (2*4 + 1) // pages of two sheets and a cover
+struct page_pool_t {
+	PopplerDocument *document;
+	struct pool_entry_t *entries; // indexed by document page number
+	int npages;
+	int capacity;
+	int resident;
+	int lru_head, lru_tail;
+	int loads;
+	int hits;
+	int evictions;
+	int keep_recordings; // keep recordings made for the trim pass for the layout
+	int recordings;
+	int recording_hits;
+	struct memory_t *memory; // recordings are accounted against it
+	size_t *recording_sizes; // estimated for every document page, NULL to not account
+};
+
+struct page_pool_t* page_pool_new(PopplerDocument *document, int capacity);
+PopplerPage* page_pool_get(struct page_pool_t *pool, int num);
+void page_pool_put(struct page_pool_t *pool, int num);
+cairo_surface_t* page_pool_get_recording(struct page_pool_t *pool, int num);
+cairo_surface_t* page_pool_find_recording(struct page_pool_t *pool, int num);
+void page_pool_set_recording(struct page_pool_t *pool, int num, cairo_surface_t *recording);
+void page_pool_drop_recording(struct page_pool_t *pool, int num);
+int page_pool_keep_recording(struct page_pool_t *pool, int num);
+void page_pool_free(struct page_pool_t *pool);
+void print_page_pool_stats(struct page_pool_t *pool);
+
+struct progress_t {
+	int fd; // -1 when progress reporting is off
+	const char *stage;
+	const char *unit;
+	int total;
+	double start;
+	double last_report;
 };
 
+double progress_now();
+long progress_peak_rss_kb();
+void progress_init(struct progress_t *progress, int fd);
+void progress_start(struct progress_t *progress, const char *stage, const char *unit, int total);
+void progress_update(struct progress_t *progress, int done);
+void progress_finish(struct progress_t *progress);
+
+struct memory_t {
+	size_t limit; // bytes, 0 for no limit
+	size_t used;
+	size_t peak;
+	int dropped_recordings; // not kept for the layout to stay within the limit
+	int limited_threads; // threads started instead of the ones asked for, 0 if not limited
+	pthread_mutex_t lock; // protects used and peak
+};
+
+struct memory_t* memory_new(size_t limit);
+void memory_free(struct memory_t *memory);
+void memory_add(struct memory_t *memory, size_t size);
+void memory_release(struct memory_t *memory, size_t size);
+size_t memory_available(struct memory_t *memory);
+int memory_threads(struct memory_t *memory, size_t per_thread, int wanted);
+void print_memory_stats(struct memory_t *memory);
+
 struct pages_t {
 	struct page_t *pages;
 	int npages;
+	struct progress_t progress;
+	struct page_pool_t *pool;
+	cairo_rectangle_t *crop_boxes; // shared by the pages using the same crop box
+	int ncrop_boxes;
+	int allocated_crop_boxes;
+	struct pdf_file_t *pdf; // objects of the input, NULL if not needed or unreadable
+	int fast_trim;
+	int trimmed_pages;
+	int fast_trimmed_pages;
+	int trim_sample;
+	int sampled_pages;
+	int escalated_pages; // unsampled pages that had to be drawn
+	int passthrough; // draw scanned pages without decoding their images
+	int passthrough_pages;
+	enum color_t color;
+	int converted_pages;
+	struct workers_t *workers; // NULL when pages are drawn on the main thread
+	struct memory_t *memory;
+	size_t *recording_sizes; // estimated for every document page, NULL without a memory limit
+	size_t largest_recording;
+	struct pipeline_t *pipeline; // NULL when pages are trimmed before the layout
 };
 
 struct pages_t* all_pages(PopplerDocument*, struct options_t);
+void worker_pages(struct pages_t *copy, struct pages_t *pages, PopplerDocument *document);
+void worker_pages_finish(struct pages_t *copy, struct pages_t *pages);
+int new_crop_box(struct pages_t *pages);
+cairo_rectangle_t* page_crop_box(struct pages_t *pages, struct page_t *page);
+void pages_free(struct pages_t *pages);
+
+enum pdf_type_t {pdf_null, pdf_bool, pdf_number, pdf_string, pdf_name, pdf_array, pdf_dict, pdf_stream, pdf_ref};
+struct pdf_value_t {
+	enum pdf_type_t type;
+	double number; // pdf_number and pdf_bool
+	int num, gen; // pdf_ref
+	char *string; // pdf_name and pdf_string
+	int length; // bytes of a string, items of an array or dict
+	int allocated;
+	struct pdf_value_t **items;
+	char **keys; // pdf_dict and pdf_stream
+	const unsigned char *stream; // pdf_stream data, still encoded
+	size_t stream_length;
+};
+
+enum pdf_token_type_t {token_eof, token_number, token_name, token_string, token_hex_string, token_keyword,
+	token_array_open, token_array_close, token_dict_open, token_dict_close};
+struct pdf_token_t {
+	enum pdf_token_type_t type;
+	const unsigned char *start;
+	size_t length;
+};
+
+struct pdf_lexer_t {
+	const unsigned char *data;
+	size_t pos;
+	size_t size;
+};
+
+struct pdf_xref_t {
+	char type; // 0 unknown, 'f' free, 'n' at offset, 'c' in object stream
+	int loading;
+	size_t offset;
+	size_t end; // after endobj, once the object was read
+	int gen;
+	int stream_num; // 'c' objects
+	int index;
+	unsigned char *decoded; // object streams
+	size_t decoded_length;
+};
+
+struct pdf_file_t {
+	const unsigned char *data;
+	size_t size;
+	int owns_data;
+	struct pdf_xref_t *xref; // indexed by object number
+	struct pdf_value_t **objects;
+	int nobjects;
+	struct pdf_value_t *trailer;
+	int has_xref_stream;
+	int *pages; // object numbers of the pages, NULL until needed
+	int npages;
+	int allocated_pages;
+};
+
+struct pdf_file_t* pdf_file_open(const char *filename);
+struct pdf_file_t* pdf_file_open_data(const unsigned char *data, size_t size);
+void pdf_file_free(struct pdf_file_t *file);
+struct pdf_value_t* pdf_get_object(struct pdf_file_t *file, int num);
+struct pdf_value_t* pdf_parse_indirect(struct pdf_file_t *file, const unsigned char *data, size_t size, size_t offset, int *num, size_t *end);
+struct pdf_value_t* pdf_resolve(struct pdf_file_t *file, struct pdf_value_t *value);
+struct pdf_value_t* pdf_dict_get(struct pdf_value_t *dict, const char *key);
+struct pdf_value_t* pdf_dict_resolve(struct pdf_file_t *file, struct pdf_value_t *dict, const char *key);
+int pdf_is_name(struct pdf_value_t *value, const char *name);
+long pdf_integer(struct pdf_file_t *file, struct pdf_value_t *value, long fallback);
+unsigned char* pdf_stream_decode(struct pdf_file_t *file, struct pdf_value_t *stream, size_t *length);
+int pdf_page_count(struct pdf_file_t *file);
+struct pdf_value_t* pdf_page(struct pdf_file_t *file, int index);
+struct pdf_value_t* pdf_page_attribute(struct pdf_file_t *file, struct pdf_value_t *page, const char *key);
+unsigned char* pdf_page_contents(struct pdf_file_t *file, struct pdf_value_t *page, size_t *length);
+void pdf_skip_inline_image(struct pdf_lexer_t *lexer);
+char* pdf_decode_name(struct pdf_token_t *token);
+void pdf_value_free(struct pdf_value_t *value);
+int pdf_next_token(struct pdf_lexer_t *lexer, struct pdf_token_t *token);
+int pdf_token_is(struct pdf_token_t *token, const char *keyword);
+int pdf_token_is_integer(struct pdf_token_t *token);
+double pdf_token_number(struct pdf_token_t *token);
+struct pdf_value_t* pdf_parse_value(struct pdf_lexer_t *lexer);
+
+#define HASH_SEED 14695981039346656037ULL
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t length);
+
+struct buffer_t {
+	char *data;
+	size_t length;
+	size_t allocated;
+};
+
+void buffer_append(struct buffer_t *buffer, const void *data, size_t length);
+void buffer_printf(struct buffer_t *buffer, const char *format, ...);
+
+struct dedup_stats_t {
+	int objects; // duplicates removed
+	size_t bytes; // size of the removed duplicates
+};
+
+#define WRITE_BUFFER_SIZE (1 << 20)
+struct writer_t {
+	bookmaker_write_func_t write;
+	void *closure;
+	struct buffer_t *buffers; // a ring, written from head by the thread
+	int nbuffers;
+	size_t size;
+	pthread_t thread;
+	pthread_mutex_t lock; // protects head, count, done and error
+	pthread_cond_t changed;
+	int head;
+	int count; // full buffers waiting for or being written by the thread
+	int done;
+	int error;
+	double blocked; // seconds the layout waited for a free buffer
+	double busy; // seconds the thread spent writing
+	size_t bytes;
+};
+
+struct writer_t* writer_new(bookmaker_write_func_t write, void *closure, int nbuffers, size_t size);
+void* writer_thread(void *data);
+int writer_write(struct writer_t *writer, const unsigned char *data, unsigned int length);
+int writer_finish(struct writer_t *writer);
+void writer_free(struct writer_t *writer);
+
+char* dedup_file(char *filename, struct dedup_stats_t *stats);
+int dedup_data(const unsigned char *data, size_t size, struct buffer_t *output, struct dedup_stats_t *stats);
+
+struct worker_stats_t {
+	double busy; // seconds spent running tasks
+	int tasks;
+	int stolen; // tasks taken from the queue of another worker
+};
+
+struct deque_t;
+struct scheduler_thread_t;
+struct scheduler_t {
+	int nworkers;
+	void **contexts; // passed to the tasks run by each worker
+	struct deque_t *deques;
+	struct worker_stats_t *stats;
+	double wall; // seconds from starting runs until they were waited for
+	int steal; // FALSE runs every task on the worker it was given to
+
+	// the threads live as long as the scheduler and wait for the next run
+	pthread_t *threads;
+	struct scheduler_thread_t *thread_data;
+	pthread_mutex_t lock; // protects the run and the counts below
+	pthread_cond_t started; // a run was handed out or the scheduler stops
+	pthread_cond_t finished; // the last thread finished the run
+	void (*run_task)(void *context, int task);
+	int *tasks;
+	double *costs;
+	int runs; // handed out so far
+	int running; // threads still working on the current run
+	double run_start; // when the current run was started
+	int stopping;
+	struct failure_t *failures; // of every thread
+	char *error; // of the first task of the current run that failed
+};
+
+struct scheduler_t* scheduler_new(int nworkers, void **contexts);
+void scheduler_free(struct scheduler_t *scheduler);
+void* scheduler_thread(void *data);
+void scheduler_start(struct scheduler_t *scheduler, void (*run_task)(void *context, int task), int *tasks, double *costs, int ntasks);
+void scheduler_wait(struct scheduler_t *scheduler);
+void scheduler_run(struct scheduler_t *scheduler, void (*run_task)(void *context, int task), int *tasks, double *costs, int ntasks);
+void print_scheduler_stats(struct scheduler_t *scheduler, char *stage);
+void reset_scheduler_stats(struct scheduler_t *scheduler);
+
+struct worker_t;
+struct workers_t {
+	int n;
+	struct worker_t *workers;
+	struct scheduler_t *scheduler;
+	double *costs; // estimated for every document page
+	cairo_surface_t **recordings; // of document pages, made ahead of the layout
+	int *record_tasks; // of the sheets being recorded, kept until they are done
+	double *record_costs;
+	pthread_mutex_t lock; // protects done
+	int done;
+};
+
+void page_size(struct pdf_file_t *pdf, int num, double *content, double *pixels);
+double page_cost(struct pdf_file_t *pdf, int num);
+size_t page_memory(struct pdf_file_t *pdf, int num);
+size_t document_memory(struct pages_t *pages);
+void start_workers(struct pages_t *pages, struct options_t options);
+void stop_workers(struct pages_t *pages);
+void trim_in_parallel(struct pages_t *pages);
+void layout_in_parallel(cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options);
+cairo_surface_t* take_recording(struct pages_t *pages, int num);
+
+struct trim_cache_entry_t {
+	uint64_t hash; // of the page, 0 for an empty entry
+	cairo_rectangle_t ink_extents;
+	cairo_surface_t *recording; // of the page, NULL if it was not kept
+};
+
+struct trim_cache_t {
+	struct trim_cache_entry_t *entries;
+	int size;
+};
+
+struct hash_memo_t {
+	uint64_t *hashes; // of indirect objects by number, 0 until hashed
+	int *depths; // the hashes were cut off at
+	int size;
+};
+uint64_t page_hash(struct pdf_file_t *pdf, struct hash_memo_t *memo, int num);
+struct trim_cache_t* trim_cache_new();
+void trim_cache_free(struct trim_cache_t *cache);
+uint64_t* use_trim_cache(struct trim_cache_t *cache, struct pages_t *pages);
+void update_trim_cache(struct trim_cache_t *cache, struct pages_t *pages, uint64_t *hashes);
+struct watcher_t {
+	char *filename;
+	char *name; // in its directory, which is watched with inotify
+	int fd;
+	struct stat last; // of the input, where it is polled
+};
+struct watcher_t* watcher_new(char *filename);
+void wait_for_change(struct watcher_t *watcher);
+void watcher_free(struct watcher_t *watcher);
 
 void exit_if_cairo_status_not_success(cairo_t* cr, char* file, int line);
 void write_surface_to_file_showing_crop_box(char* filename, cairo_surface_t *recording_surface, cairo_rectangle_t *crop_box);
+void set_deterministic_metadata(cairo_surface_t *surface);
+int verify_book(struct bookmaker_t *job);
 PopplerDocument* open_document(char* filename);
+PopplerDocument* open_input_document(struct options_t options);
+struct pdf_file_t* open_input_objects(struct options_t options);
+
+struct pipeline_t {
+	struct pages_t pages; // of the thread, sharing the pages and crop boxes
+	PopplerDocument *document;
+	struct options_t options;
+	pthread_t thread;
+	pthread_mutex_t lock; // protects everything below
+	pthread_cond_t changed;
+	int *trimmed; // TRUE for every page whose crop box is ready
+	int done;
+	double waited; // seconds the layout waited for crop boxes
+	char *error; // of the thread, NULL unless trimming failed
+	struct failure_t failure; // of the thread, only used by the thread
+};
+
+void start_pipeline(struct pages_t *pages, struct options_t options);
+void wait_for_trim(struct pages_t *pages, struct page_t *page);
+double finish_pipeline(struct pages_t *pages);
+char* stop_pipeline(struct pages_t *pages);
 
 void add_even_odd_cropboxes(PopplerDocument *document, struct pages_t *pages);
 void add_document_cropboxes(PopplerDocument *document, struct pages_t *pages);
 void add_per_page_cropboxes(PopplerDocument *document, struct pages_t *pages);
+cairo_rectangle_t* page_ink_extents(struct pages_t *pages, struct page_t *page);
+void add_to_crop_box(cairo_rectangle_t *crop_box, cairo_rectangle_t *extents);
+void add_sampled_cropboxes(struct pages_t *pages, int *crop_boxes, int ngroups);
+int fast_ink_extents(struct pages_t *pages, struct page_t *page, cairo_rectangle_t *extents);
 
 void exit_if_cairo_surface_status_not_success(cairo_surface_t* surface, char* file, int line);
 
 
 void make_chapbook(char*, char*);
 int get_num_pages_to_layout(int npages);
+int layout_page_num(int page_to_layout, int num_pages_to_layout, struct options_t options);
+void layout_sheets(cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options, int first_sheet, int nsheets);
+char* split_book(struct pages_t *pages, struct options_t options, struct dedup_stats_t *dedup);
 void layout(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options);
+struct passthrough_image_t {
+	cairo_matrix_t matrix; // image unit square to page coordinates
+	struct pdf_value_t *image;
+	int num;
+	int width, height;
+	const char *mime_type; // NULL for images that can not be passed through
+};
+
+int passthrough_page_images(struct pages_t *pages, int num, double box[4], int any_image, struct passthrough_image_t **images);
+cairo_surface_t* color_page_recording(struct pages_t *pages, int num);
+void draw_recording(cairo_surface_t *recording, cairo_rectangle_t *crop_box, cairo_t *cr);
+int can_pass_through(struct pages_t *pages, int num);
+int draw_passthrough_page(struct pages_t *pages, int num, cairo_t *cr);
+void draw_page(struct pages_t *pages, int num, cairo_rectangle_t *crop_box, cairo_t *cr, struct options_t options);
 void add_cover(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options);
 
+struct bookmaker_t {
+	struct options_t options;
+	int library; // fail returns from the library call instead of exiting
+	int watch; // fail returns from the run, which is made again on the next change
+	int dedups_file; // the command line deduplicates the file it wrote itself
+	struct trim_cache_t *trim_cache; // ink extents of the previous run, NULL if not kept
+	unsigned char *input_data; // copy of the input opened from memory
+	char **strings; // option values owned by the job
+	int nstrings;
+	PopplerDocument *document;
+	struct pages_t *pages;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	bookmaker_write_func_t write;
+	void *closure;
+	struct buffer_t output; // the book, when it is deduplicated in memory before writing
+	struct writer_t *writer; // NULL when the layout writes itself
+	cairo_rectangle_t *crop_boxes; // of every page, kept for --verify
+	struct bookmaker_timings_t timings;
+	char *error;
+	jmp_buf failed;
+};
+
+struct bookmaker_t* bookmaker_new_with_options(struct options_t options);
+double stage_start(char *name);
+void stage_finish(double start, double *timing);
+
 #endif /* _ALL_H */
\ No newline at end of file
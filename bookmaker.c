@@ -0,0 +1,470 @@
+#include "all.h"
+
+// method: the command line and libbookmaker both make books with a job.
+// Errors deep inside bookmaker call fail, which exits the command line. A
+// library call sets the job running on its thread and a jump back to itself,
+// so fail can return from the call with the error instead. Threads started
+// by a job catch their failures, which the job raises once they are joined.
+
+static __thread struct bookmaker_t *running_job = NULL;
+static __thread struct failure_t *thread_failure = NULL;
+
+// ends the job, or the thread, with error, which it takes over
+void fail_with_error(char *error) {
+	struct bookmaker_t *job = running_job;
+	struct failure_t *failure = thread_failure;
+
+	if (failure != NULL) {
+		free(failure->error);
+		failure->error = error;
+		longjmp(failure->failed, 1);
+	}
+	if (job != NULL && (job->library || job->watch)) {
+		free(job->error);
+		job->error = error;
+		longjmp(job->failed, 1);
+	}
+	printf("%s\n", error != NULL ? error : "ERROR");
+	free(error);
+	exit(1);
+}
+
+void fail(const char *format, ...) {
+	char *error;
+	va_list args;
+	va_start(args, format);
+	if (vasprintf(&error, format, args) < 0) {
+		error = strdup(format);
+	}
+	va_end(args);
+	fail_with_error(error);
+}
+
+// makes fail on this thread record the error in failure and jump to it
+void catch_failures(struct failure_t *failure) {
+	thread_failure = failure;
+}
+
+// fails with the error a thread recorded, if it failed, and takes it over
+void raise_failure(char *error) {
+	if (error != NULL) {
+		fail_with_error(error);
+	}
+}
+
+void message(const char *format, ...) {
+	if (running_job != NULL && running_job->library) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	fflush(stdout);
+}
+
+double stage_start(char *name) {
+	message("%s ", name);
+	return progress_now();
+}
+
+void stage_finish(double start, double *timing) {
+	*timing = progress_now() - start;
+	message("%fs\n", *timing);
+}
+
+struct bookmaker_t* bookmaker_new_with_options(struct options_t options) {
+	struct bookmaker_t *job = calloc(1, sizeof(struct bookmaker_t));
+	job->options = options;
+	return job;
+}
+
+struct bookmaker_t* bookmaker_new(void) {
+	struct options_t options = default_options("libbookmaker");
+	// write is called on the caller's thread unless asked otherwise
+	options.write_buffers = 0;
+	struct bookmaker_t *job = bookmaker_new_with_options(options);
+	job->library = TRUE;
+	return job;
+}
+
+// keeps a copy of value for as long as the job
+char* job_string(struct bookmaker_t *job, const char *value) {
+	job->strings = realloc(job->strings, sizeof(char*) * (job->nstrings + 1));
+	job->strings[job->nstrings] = strdup(value);
+	return job->strings[job->nstrings++];
+}
+
+int bookmaker_set_option(struct bookmaker_t *job, const char *name, const char *value) {
+	free(job->error);
+	job->error = NULL;
+
+	int has_value;
+	int option = find_option(name, &has_value);
+	if (option == -1 || strcmp(name, "help") == 0 || strcmp(name, "version") == 0) {
+		asprintf(&job->error, "Unknown option: %s", name);
+		return FALSE;
+	}
+	if (strcmp(name, "print") == 0 || strcmp(name, "printer") == 0 || strcmp(name, "split") == 0
+		|| strcmp(name, "watch") == 0 || strcmp(name, "sync") == 0
+		|| strcmp(name, "verify") == 0) {
+		asprintf(&job->error, "%s is not available in the library", name);
+		return FALSE;
+	}
+	if (has_value && value == NULL) {
+		asprintf(&job->error, "%s needs a value", name);
+		return FALSE;
+	}
+
+	job->error = set_option(&job->options, option, has_value ? job_string(job, value) : NULL);
+	return job->error == NULL;
+}
+
+// frees the parts of a run, also after it failed
+void bookmaker_cleanup(struct bookmaker_t *job) {
+	if (job->cr != NULL) {
+		cairo_destroy(job->cr);
+		job->cr = NULL;
+	}
+	if (job->surface != NULL) {
+		cairo_surface_destroy(job->surface);
+		job->surface = NULL;
+	}
+	// after the surface, destroying it can still write
+	if (job->writer != NULL) {
+		writer_finish(job->writer);
+		writer_free(job->writer);
+		job->writer = NULL;
+	}
+	if (job->pages != NULL) {
+		pages_free(job->pages);
+		job->pages = NULL;
+	}
+	free(job->output.data);
+	job->output.data = NULL;
+	job->output.length = 0;
+	job->output.allocated = 0;
+}
+
+void bookmaker_free(struct bookmaker_t *job) {
+	bookmaker_cleanup(job);
+	if (job->document != NULL) {
+		g_object_unref(job->document);
+	}
+	int i;
+	for (i = 0; i < job->nstrings; i++) {
+		free(job->strings[i]);
+	}
+	free(job->strings);
+	free(job->input_data);
+	free(job->crop_boxes);
+	free(job->error);
+	free(job);
+}
+
+void open_job_document(struct bookmaker_t *job) {
+	double start = progress_now();
+	if (job->document != NULL) {
+		fail("A document was already opened");
+	}
+	job->document = open_input_document(job->options);
+	job->timings.open = progress_now() - start;
+}
+
+int bookmaker_open_data(struct bookmaker_t *job, const unsigned char *data, size_t length) {
+	running_job = job;
+	if (setjmp(job->failed) != 0) {
+		running_job = NULL;
+		return FALSE;
+	}
+
+	if (length > G_MAXINT) {
+		fail("Documents in memory can not be larger than %d bytes", G_MAXINT);
+	}
+	job->input_data = malloc(length);
+	memcpy(job->input_data, data, length);
+	job->options.input_data = job->input_data;
+	job->options.input_length = length;
+	open_job_document(job);
+
+	running_job = NULL;
+	return TRUE;
+}
+
+int bookmaker_open_file(struct bookmaker_t *job, const char *filename) {
+	running_job = job;
+	if (setjmp(job->failed) != 0) {
+		running_job = NULL;
+		return FALSE;
+	}
+
+	job->options.input_filename = job_string(job, filename);
+	open_job_document(job);
+
+	running_job = NULL;
+	return TRUE;
+}
+
+// the library deduplicates the book in memory before it is written, the
+// command line deduplicates the file it wrote, split books every part
+int dedups_in_memory(struct bookmaker_t *job) {
+	return job->options.dedup && !job->options.print && job->options.split == 0 && !job->dedups_file;
+}
+
+cairo_status_t write_to_job(void *closure, const unsigned char *data, unsigned int length) {
+	struct bookmaker_t *job = closure;
+
+	// deduplicating in memory needs the whole book
+	if (dedups_in_memory(job)) {
+		buffer_append(&job->output, data, length);
+		if (job->pages != NULL) {
+			memory_add(job->pages->memory, length);
+		}
+		return CAIRO_STATUS_SUCCESS;
+	}
+
+	if (job->writer != NULL) {
+		return writer_write(job->writer, data, length) != 0 ? CAIRO_STATUS_WRITE_ERROR : CAIRO_STATUS_SUCCESS;
+	}
+
+	double start = progress_now();
+	int error = job->write(job->closure, data, length);
+	job->timings.write += progress_now() - start;
+	return error != 0 ? CAIRO_STATUS_WRITE_ERROR : CAIRO_STATUS_SUCCESS;
+}
+
+void write_job_output(struct bookmaker_t *job, const char *data, size_t length) {
+	while (length > 0) {
+		unsigned int chunk = length > G_MAXUINT ? G_MAXUINT : length;
+		if (job->write(job->closure, (const unsigned char*) data, chunk) != 0) {
+			fail("%s:%d: %s", __FILE__, __LINE__, cairo_status_to_string(CAIRO_STATUS_WRITE_ERROR));
+		}
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+// keeps what the trim found for the next run and for --verify
+void finish_trim(struct bookmaker_t *job, uint64_t *hashes) {
+	struct pages_t *pages = job->pages;
+	if (hashes != NULL) {
+		update_trim_cache(job->trim_cache, pages, hashes);
+		free(hashes);
+	}
+	if (job->options.verify) {
+		free(job->crop_boxes);
+		job->crop_boxes = malloc(sizeof(cairo_rectangle_t)*pages->npages);
+		int page_num;
+		for (page_num = 0; page_num < pages->npages; page_num++) {
+			job->crop_boxes[page_num] = *page_crop_box(pages, &pages->pages[page_num]);
+		}
+	}
+	if (job->options.fast_trim) {
+		message("Trimmed %d of %d pages from their text layout\n", pages->fast_trimmed_pages, pages->trimmed_pages);
+	}
+	if (job->options.trim_sample > 0) {
+		message("Sampled %d of %d pages, %d more had to be trimmed\n", pages->sampled_pages, pages->npages, pages->escalated_pages);
+	}
+}
+
+void make_book(struct bookmaker_t *job) {
+	struct options_t *options = &job->options;
+
+	char *error = check_options(options);
+	if (error != NULL) {
+		char *text;
+		asprintf(&text, "ERROR: %s", error);
+		free(error);
+		fail_with_error(text);
+	}
+
+	switch (options->paper) {
+	case a4:
+		// 1 pt = 1/27 in
+		// 1 in = 2.54 cm
+		// A4 210x297mm = 595.224x841.824 
+		options->paper_height = 595.224;
+		options->paper_width = 841.824;
+		break;
+	case letter:
+		// LETTER 8.5x11in = 612x792
+		options->paper_height = 612;
+		options->paper_width = 792;
+		break;
+	default:
+		NOT_IMPLEMENTED();
+	}
+
+	// create the output document
+	if (options->print) {
+		// if sending to a printer instead of a file, we can generate ps directly
+		job->surface = cairo_ps_surface_create_for_stream(write_to_job, job, options->paper_width, options->paper_height);
+	} else if (options->split == 0) {
+		job->surface = cairo_pdf_surface_create_for_stream(write_to_job, job, options->paper_width, options->paper_height);
+		if (options->dedup) {
+			// keep every object at the top level so the file can be rewritten
+			cairo_pdf_surface_restrict_to_version(job->surface, CAIRO_PDF_VERSION_1_4);
+		}
+		if (options->deterministic) {
+			set_deterministic_metadata(job->surface);
+		}
+	}
+	// the book is written while it is laid out, unless it is deduplicated first
+	if (job->surface != NULL && options->write_buffers > 0 && !dedups_in_memory(job)) {
+		job->writer = writer_new(job->write, job->closure, options->write_buffers, WRITE_BUFFER_SIZE);
+	}
+
+	// split books create a surface for every part
+	if (job->surface != NULL) {
+		exit_if_cairo_surface_status_not_success(job->surface, __FILE__, __LINE__);
+		job->cr = cairo_create(job->surface);
+		exit_if_cairo_status_not_success(job->cr, __FILE__, __LINE__);
+	}
+
+	double start = stage_start("Inspecting PDF");
+
+	// figure out which pages to layout
+	struct pages_t *pages = all_pages(job->document, *options);
+	job->pages = pages;
+	// the write buffers are kept until the book is written
+	if (job->writer != NULL) {
+		memory_add(pages->memory, job->writer->nbuffers * job->writer->size);
+	}
+
+	uint64_t *hashes = NULL;
+	if (job->trim_cache != NULL) {
+		hashes = use_trim_cache(job->trim_cache, pages);
+	}
+
+	// sampling draws few pages, the rest are checked on the main thread
+	if (pages->workers != NULL && options->trim_sample == 0 && !options->pipeline) {
+		trim_in_parallel(pages);
+	}
+
+	// get the crop boxes for the pages
+	switch (options->trim) {
+	case even_odd:
+		add_even_odd_cropboxes(job->document, pages);
+		break;
+	case document:
+		add_document_cropboxes(job->document, pages);
+		break;
+	case per_page:
+		if (options->pipeline) {
+			// the layout starts while the pages are trimmed
+			start_pipeline(pages, *options);
+		} else {
+			add_per_page_cropboxes(job->document, pages);
+		}
+		break;
+	default:
+		NOT_IMPLEMENTED();
+	}
+	stage_finish(start, &job->timings.trim);
+	if (!options->pipeline) {
+		finish_trim(job, hashes);
+	}
+
+	start = stage_start("Creating Book");
+
+	char *manifest_filename = NULL;
+	struct dedup_stats_t stats = {0, 0};
+	if (options->split > 0) {
+		manifest_filename = split_book(pages, *options, &stats);
+	} else {
+		if (options->add_cover) {
+			add_cover(job->document, job->surface, job->cr, pages, *options);
+		}
+
+		// layout the pages
+		layout(job->document, job->surface, job->cr, pages, *options);
+	}
+
+	if (options->pipeline) {
+		double waited = finish_pipeline(pages);
+		message("Laid out while trimming, waited %fs for pages to be trimmed\n", waited);
+		finish_trim(job, hashes);
+	}
+
+	if (pages->passthrough) {
+		message("Passed the images of %d scanned pages through\n", pages->passthrough_pages);
+	}
+	if (pages->color != color_keep) {
+		message("Converted %d scanned pages to %s\n", pages->converted_pages,
+			pages->color == color_gray ? "gray" : "black and white");
+	}
+	print_page_pool_stats(pages->pool);
+
+	if (job->surface != NULL) {
+		exit_if_cairo_status_not_success(job->cr, __FILE__, __LINE__);
+		cairo_destroy(job->cr);
+		job->cr = NULL;
+
+		cairo_surface_finish(job->surface);
+		exit_if_cairo_surface_status_not_success(job->surface, __FILE__, __LINE__);
+		cairo_surface_destroy(job->surface);
+		job->surface = NULL;
+	}
+	if (job->writer != NULL) {
+		int error = writer_finish(job->writer);
+		job->timings.write = job->writer->blocked;
+		message("Writer thread wrote %zu bytes in %fs\n", job->writer->bytes, job->writer->busy);
+		writer_free(job->writer);
+		job->writer = NULL;
+		if (error) {
+			fail("%s:%d: %s", __FILE__, __LINE__, cairo_status_to_string(CAIRO_STATUS_WRITE_ERROR));
+		}
+	}
+	stage_finish(start, &job->timings.layout);
+	if (job->timings.layout > 0 && !dedups_in_memory(job) && options->split == 0) {
+		message("Waited %fs for the output to be written (%.0f%% of creating the book)\n",
+			job->timings.write, 100 * job->timings.write / job->timings.layout);
+	}
+
+	if (manifest_filename != NULL) {
+		message("Parts listed in %s\n", manifest_filename);
+		free(manifest_filename);
+	} else if (dedups_in_memory(job)) {
+		start = stage_start("Deduplicating resources");
+		struct buffer_t deduplicated = {NULL, 0, 0};
+		if (dedup_data((unsigned char*) job->output.data, job->output.length, &deduplicated, &stats)) {
+			free(job->output.data);
+			job->output = deduplicated;
+		}
+		write_job_output(job, job->output.data, job->output.length);
+		stage_finish(start, &job->timings.dedup);
+	}
+	if (dedups_in_memory(job) || (options->dedup && options->split > 0)) {
+		message("Removed %d duplicate images and fonts (%zu bytes)\n", stats.objects, stats.bytes);
+	}
+	print_memory_stats(job->pages->memory);
+}
+
+int bookmaker_run(struct bookmaker_t *job, bookmaker_write_func_t write, void *closure) {
+	running_job = job;
+	if (setjmp(job->failed) != 0) {
+		bookmaker_cleanup(job);
+		running_job = NULL;
+		return FALSE;
+	}
+
+	if (job->document == NULL) {
+		fail("No document was opened");
+	}
+	job->write = write;
+	job->closure = closure;
+	make_book(job);
+
+	bookmaker_cleanup(job);
+	running_job = NULL;
+	return TRUE;
+}
+
+const char* bookmaker_error(struct bookmaker_t *job) {
+	return job->error;
+}
+
+struct bookmaker_timings_t bookmaker_timings(struct bookmaker_t *job) {
+	return job->timings;
+}
@@ -0,0 +1,57 @@
+#ifndef _BOOKMAKER_H
+#define _BOOKMAKER_H
+
+#include <stddef.h>
+
+// libbookmaker makes books in the same process, without running bookmaker
+//
+//	struct bookmaker_t *job = bookmaker_new();
+//	bookmaker_set_option(job, "type", "perfect");
+//	if (!bookmaker_open_data(job, data, length) || !bookmaker_run(job, write, closure)) {
+//		fprintf(stderr, "%s\n", bookmaker_error(job));
+//	}
+//	bookmaker_free(job);
+//
+// Functions returning int return 1 on success. On failure they return 0 and
+// bookmaker_error describes what went wrong. A job makes one book, jobs on
+// different threads do not share anything.
+
+// the rest of bookmaker is hidden from programs using the shared library
+#define BOOKMAKER_API __attribute__ ((visibility ("default")))
+
+struct bookmaker_t;
+
+// receives the book as it is written, returns 0 if all of data was written
+typedef int (*bookmaker_write_func_t)(void *closure, const unsigned char *data, unsigned int length);
+
+// wall clock seconds spent in each stage of the job
+struct bookmaker_timings_t {
+	double open; // reading the document
+	double trim; // finding the crop boxes
+	double layout; // laying out and writing the book
+	double dedup; // deduplicating images and fonts, with "dedup"
+	double write; // of layout, spent waiting for the write function
+};
+
+BOOKMAKER_API struct bookmaker_t* bookmaker_new(void);
+BOOKMAKER_API void bookmaker_free(struct bookmaker_t *job);
+
+// sets an option of the command line, named without the leading --, e.g.
+// ("paper", "letter") or ("dedup", NULL). print, printer, split, watch, sync
+// and verify use files instead of the write function and are not available.
+// write is called on the thread calling bookmaker_run. With "write-buffers"
+// set to 2 or more, it is called on a thread of its own instead, one call at
+// a time and in order.
+BOOKMAKER_API int bookmaker_set_option(struct bookmaker_t *job, const char *name, const char *value);
+
+// the data is copied, the caller can free it when this returns
+BOOKMAKER_API int bookmaker_open_data(struct bookmaker_t *job, const unsigned char *data, size_t length);
+BOOKMAKER_API int bookmaker_open_file(struct bookmaker_t *job, const char *filename);
+
+// trims, adds the cover and lays out the book, writing it to write
+BOOKMAKER_API int bookmaker_run(struct bookmaker_t *job, bookmaker_write_func_t write, void *closure);
+
+BOOKMAKER_API const char* bookmaker_error(struct bookmaker_t *job);
+BOOKMAKER_API struct bookmaker_timings_t bookmaker_timings(struct bookmaker_t *job);
+
+#endif /* _BOOKMAKER_H */
@@ -0,0 +1,54 @@
+#!/bin/sh
+# make check: makes a book of a generated document for every type, trim,
+# paper and cover, once on the serial path and once with the fast paths, and
+# fails if --verify finds a difference from the reference book.
+# --fast-trim and --trim-sample find different margins by design and are
+# not part of the fast paths checked here.
+
+BOOKMAKER=${BOOKMAKER:-./bookmaker}
+TESTPDF=${TESTPDF:-./testpdf}
+
+directory=$(mktemp -d "${TMPDIR:-/tmp}/bookmaker-check.XXXXXX") || exit 1
+trap 'rm -rf "$directory"' EXIT
+
+input="$directory/input.pdf"
+"$TESTPDF" "$input" 13 || exit 1
+
+runs=0
+failures=0
+for type in chapbook perfect; do
+	for trim in even-odd document per-page; do
+		for paper in a4 letter; do
+			for cover in none first-page title; do
+				case $cover in
+				none) cover_options="";;
+				first-page) cover_options="--cover";;
+				title) cover_options="--title Check --author bookmaker --date today";;
+				esac
+
+				for path in serial fast; do
+					case $path in
+					serial) path_options="--threads 1 --write-buffers 0";;
+					fast) path_options="--threads 4 --engine xobject --dedup --passthrough --max-memory 256";;
+					esac
+					if [ $path = fast ] && [ $trim = per-page ]; then
+						path_options="$path_options --pipeline"
+					fi
+
+					options="--type $type --trim $trim --paper $paper $cover_options $path_options"
+					output="$directory/book.pdf"
+					runs=$((runs + 1))
+					if ! "$BOOKMAKER" --verify $options "$input" "$output" > "$directory/log" 2>&1; then
+						failures=$((failures + 1))
+						echo "FAIL: bookmaker --verify $options"
+						cat "$directory/log"
+					fi
+					rm -f "$output"
+				done
+			done
+		done
+	done
+done
+
+echo "$((runs - failures)) of $runs books match their reference"
+[ $failures -eq 0 ]
@@ -0,0 +1,169 @@
+#include "all.h"
+
+// method: with --color gray or bitonal, pages that only draw images, i.e.
+// scans, are drawn into an image at the resolution of their most detailed
+// image, from the recording kept while trimming if there is one and by
+// poppler otherwise, and converted to gray, and for bitonal to black and white
+// with a threshold that follows the local brightness of the page, so uneven
+// lighting and yellowed paper do not turn into black areas. The pdf surface
+// writes images whose pixels are all gray with one 8 bit gray component and
+// black and white images with one bit per pixel. Luminance is computed four
+// pixels at a time with vector instructions. Pages are converted by the
+// threads of --threads when there are any.
+
+#define COLOR_MAX_PIXELS (16 << 20) // keeps the sums of the threshold in 32 bits
+#define THRESHOLD_WINDOW 16 // width of the page per threshold window
+#define THRESHOLD_PERCENT 15 // darker than the window by this much is black
+
+typedef uint32_t pixels_t __attribute__ ((vector_size (16)));
+
+// rec. 601 luma, with the weights in 256ths, of rgb24 pixels
+void gray_row(uint32_t *row, int width) {
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		pixels_t pixels;
+		memcpy(&pixels, row + x, sizeof(pixels));
+		pixels_t luma = (((pixels >> 16) & 0xff) * 77 + ((pixels >> 8) & 0xff) * 150 + (pixels & 0xff) * 29) >> 8;
+		pixels = 0xff000000 | luma << 16 | luma << 8 | luma;
+		memcpy(row + x, &pixels, sizeof(pixels));
+	}
+	for (; x < width; x++) {
+		uint32_t pixel = row[x];
+		uint32_t luma = (((pixel >> 16) & 0xff) * 77 + ((pixel >> 8) & 0xff) * 150 + (pixel & 0xff) * 29) >> 8;
+		row[x] = 0xff000000 | luma << 16 | luma << 8 | luma;
+	}
+}
+
+// thresholds a gray image against the mean of the window around every pixel
+void bitonal_image(cairo_surface_t *image, struct memory_t *memory) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int stride = cairo_image_surface_get_stride(image) / sizeof(uint32_t);
+	uint32_t *pixels = (uint32_t*) cairo_image_surface_get_data(image);
+
+	// sums[y*width + x] is the sum of the gray of all pixels above and left of x, y
+	size_t size = sizeof(uint32_t) * width * height;
+	uint32_t *sums = malloc(size);
+	memory_add(memory, size);
+	int x, y;
+	for (y = 0; y < height; y++) {
+		uint32_t row_sum = 0;
+		for (x = 0; x < width; x++) {
+			row_sum += pixels[y*stride + x] & 0xff;
+			sums[y*width + x] = row_sum + (y > 0 ? sums[(y - 1)*width + x] : 0);
+		}
+	}
+
+	int half = width / THRESHOLD_WINDOW / 2;
+	if (half < 4) {
+		half = 4;
+	}
+	for (y = 0; y < height; y++) {
+		int y1 = y - half - 1;
+		int y2 = y + half < height ? y + half : height - 1;
+		for (x = 0; x < width; x++) {
+			int x1 = x - half - 1;
+			int x2 = x + half < width ? x + half : width - 1;
+
+			uint64_t sum = sums[y2*width + x2];
+			if (x1 >= 0) {
+				sum -= sums[y2*width + x1];
+			}
+			if (y1 >= 0) {
+				sum -= sums[y1*width + x2];
+			}
+			if (x1 >= 0 && y1 >= 0) {
+				sum += sums[y1*width + x1];
+			}
+			uint64_t count = (uint64_t) (x2 - (x1 >= 0 ? x1 : -1)) * (y2 - (y1 >= 0 ? y1 : -1));
+
+			uint32_t *pixel = &pixels[y*stride + x];
+			int black = (*pixel & 0xff) * count * 100 <= sum * (100 - THRESHOLD_PERCENT);
+			*pixel = black ? 0xff000000 : 0xffffffff;
+		}
+	}
+	free(sums);
+	memory_release(memory, size);
+}
+
+// returns a recording of page num in page coordinates with its images
+// converted, NULL if the page draws anything but images
+cairo_surface_t* color_page_recording(struct pages_t *pages, int num) {
+	double box[4];
+	struct passthrough_image_t *images;
+	int nimages = passthrough_page_images(pages, num, box, TRUE, &images);
+	if (nimages <= 0) {
+		return NULL;
+	}
+
+	// pixels per point of the most detailed image
+	double scale = 0;
+	int i;
+	for (i = 0; i < nimages; i++) {
+		cairo_matrix_t *matrix = &images[i].matrix;
+		double drawn_width = hypot(matrix->xx, matrix->yx);
+		double drawn_height = hypot(matrix->xy, matrix->yy);
+		if (drawn_width > 0 && drawn_height > 0) {
+			scale = fmax(scale, fmax(images[i].width / drawn_width, images[i].height / drawn_height));
+		}
+	}
+	free(images);
+
+	double page_width = box[2] - box[0];
+	double page_height = box[3] - box[1];
+	if (scale <= 0 || page_width <= 0 || page_height <= 0) {
+		return NULL;
+	}
+	if (page_width * page_height * scale * scale > COLOR_MAX_PIXELS) {
+		scale = sqrt(COLOR_MAX_PIXELS / (page_width * page_height));
+	}
+	int width = ceil(page_width * scale);
+	int height = ceil(page_height * scale);
+
+	cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	exit_if_cairo_surface_status_not_success(image, __FILE__, __LINE__);
+	size_t image_size = (size_t) cairo_image_surface_get_stride(image) * height;
+	memory_add(pages->memory, image_size);
+	cairo_t *cr = cairo_create(image);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	cairo_scale(cr, (double) width / page_width, (double) height / page_height);
+	// the converted page replaces the recording, which is not needed anymore
+	cairo_surface_t *kept = page_pool_find_recording(pages->pool, num);
+	if (kept != NULL) {
+		cairo_set_source_surface(cr, kept, 0, 0);
+		cairo_paint(cr);
+	} else {
+		PopplerPage *page = page_pool_get(pages->pool, num);
+		poppler_page_render_for_printing(page, cr);
+		page_pool_put(pages->pool, num);
+	}
+	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
+	cairo_destroy(cr);
+	page_pool_drop_recording(pages->pool, num);
+
+	cairo_surface_flush(image);
+	uint32_t *pixels = (uint32_t*) cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image) / sizeof(uint32_t);
+	int y;
+	for (y = 0; y < height; y++) {
+		gray_row(pixels + y*stride, width);
+	}
+	if (pages->color == color_bitonal) {
+		bitonal_image(image, pages->memory);
+	}
+	cairo_surface_mark_dirty(image);
+
+	cairo_surface_t *recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
+	cr = cairo_create(recording);
+	cairo_scale(cr, page_width / width, page_height / height);
+	cairo_set_source_surface(cr, image, 0, 0);
+	cairo_paint(cr);
+	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
+	cairo_destroy(cr);
+	cairo_surface_destroy(image);
+	memory_release(pages->memory, image_size);
+
+	pages->converted_pages++;
+	return recording;
+}
@@ -84,33 +84,10 @@ void add_cover(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr,
 		g_object_unref(layout);
 	} else {
 		// use the first page of the document as the cover
-		GError *error = NULL;
-
-		int cover_page_number = pages[0].pages[0].num;
-		PopplerPage *cover = poppler_document_get_page(document, cover_page_number);
-		if (cover == NULL) {
-			printf("%s:%d: %s\n", __FILE__, __LINE__, error->message);
-			exit(1);
-		}
-
-		// get the cropbox
-		cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
-		cairo_t *cropbox_cr = cairo_create(surface);
-
-		poppler_page_render_for_printing(cover, cropbox_cr);
-
-		exit_if_cairo_status_not_success(cropbox_cr, __FILE__, __LINE__);
-		cairo_destroy(cropbox_cr);
-
-		cairo_rectangle_t *crop_box = malloc(sizeof(cairo_rectangle_t));
-		cairo_recording_surface_ink_extents(surface,
-			&crop_box->x,
-			&crop_box->y,
-			&crop_box->width,
-			&crop_box->height);
-
-		cairo_surface_destroy(surface);
-		exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
+		// its crop box is the one the trim pass found for that page alone
+		struct page_t *cover_page = &pages->pages[0];
+		wait_for_trim(pages, cover_page);
+		cairo_rectangle_t *crop_box = page_ink_extents(pages, cover_page);
 
 		// render the cover
 		double WIDTH = options.paper_width/2.0 - 2*margin;
@@ -159,9 +136,7 @@ void add_cover(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr,
 
 		cairo_translate(cr, horizontal_offset, vertical_offset);
 		cairo_scale(cr, scale_factor, scale_factor);
-		poppler_page_render_for_printing(cover, cr);
-
-		g_object_unref(cover);
+		draw_page(pages, cover_page->num, crop_box, cr, options);
 	}
 	cairo_surface_show_page(surface);
 	cairo_restore(cr);
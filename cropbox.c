@@ -1,158 +1,240 @@
 #include "all.h"
 
-// method: draw all the pages to appropriate recording surfaces and then get ink extents
-void evenodd_cropboxes(PopplerDocument *document, cairo_rectangle_t *odd_page_crop_box, cairo_rectangle_t *even_page_crop_box) {
-	GError *error = NULL;
-	int num_document_pages = poppler_document_get_n_pages(document);
+// method: draw the page to a recording surface and then get its ink extents
+// (or, with --fast-trim, take them from the text layout when that is enough)
+// the extents are remembered on the page so every page is only drawn once
+cairo_rectangle_t* page_ink_extents(struct pages_t *pages, struct page_t *page) {
+	if (page->has_ink_extents) {
+		return &page->ink_extents;
+	}
+	pages->trimmed_pages++;
 
-	cairo_surface_t *odd_pages = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	cairo_surface_t *even_pages = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	int page_num;
-	for (page_num = 0; page_num < num_document_pages; page_num++) {
-		cairo_surface_t *surface = odd_pages;
-		if (page_num % 2 == 1) {
-			surface = even_pages;
-		}
-		cairo_t *cr = cairo_create(surface);
+	if (pages->fast_trim && fast_ink_extents(pages, page, &page->ink_extents)) {
+		pages->fast_trimmed_pages++;
+		page->has_ink_extents = TRUE;
+		return &page->ink_extents;
+	}
 
-		PopplerPage *page = poppler_document_get_page(document, page_num);
-		if (page == NULL) {
-			printf("%s:%d: %s\n", __FILE__, __LINE__, error->message);
-			exit(1);		
-		}
+	cairo_surface_t *surface = page_pool_get_recording(pages->pool, page->num);
+
+	cairo_rectangle_t *extents = &page->ink_extents;
+	cairo_recording_surface_ink_extents(surface,
+		&extents->x,
+		&extents->y,
+		&extents->width,
+		&extents->height);
 
-		poppler_page_render_for_printing(page, cr);
-		g_object_unref(page);
+	// use to check extent and crop box handling
+	// write_surface_to_file_showing_crop_box("page.pdf", surface, extents);
 
-		exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
-		cairo_destroy(cr);
+	// the xobject engine draws the recording again when laying out
+	if (!page_pool_keep_recording(pages->pool, page->num)) {
+		page_pool_drop_recording(pages->pool, page->num);
 	}
 
-	cairo_recording_surface_ink_extents(odd_pages,
-		&odd_page_crop_box->x,
-		&odd_page_crop_box->y,
-		&odd_page_crop_box->width,
-		&odd_page_crop_box->height);
-	cairo_recording_surface_ink_extents(even_pages,
-		&even_page_crop_box->x,
-		&even_page_crop_box->y,
-		&even_page_crop_box->width,
-		&even_page_crop_box->height);
+	page->has_ink_extents = TRUE;
+	return extents;
+}
 
-	// use to check extent and crop box handling
-	// write_surface_to_file_showing_crop_box("odd.pdf", odd_pages, odd_page_crop_box);
-	// write_surface_to_file_showing_crop_box("even.pdf", even_pages, even_page_crop_box);
-
-	// cleanup surfaces used to get crop boxes
-	cairo_surface_destroy(odd_pages);
-	exit_if_cairo_surface_status_not_success(odd_pages, __FILE__, __LINE__);
-	cairo_surface_destroy(even_pages);
-	exit_if_cairo_surface_status_not_success(even_pages, __FILE__, __LINE__);
+// grow the crop box to include the extents
+// blank pages have empty extents and do not change the crop box
+void add_to_crop_box(cairo_rectangle_t *crop_box, cairo_rectangle_t *extents) {
+	if (extents->width == 0 && extents->height == 0) {
+		return;
+	}
+	if (crop_box->width == 0 && crop_box->height == 0) {
+		*crop_box = *extents;
+		return;
+	}
+
+	double x2 = fmax(crop_box->x + crop_box->width, extents->x + extents->width);
+	double y2 = fmax(crop_box->y + crop_box->height, extents->y + extents->height);
+	crop_box->x = fmin(crop_box->x, extents->x);
+	crop_box->y = fmin(crop_box->y, extents->y);
+	crop_box->width = x2 - crop_box->x;
+	crop_box->height = y2 - crop_box->y;
+}
+
+int rectangle_contains(cairo_rectangle_t *outer, cairo_rectangle_t *inner) {
+	if (inner->width == 0 && inner->height == 0) {
+		return TRUE;
+	}
+	return inner->x >= outer->x && inner->y >= outer->y &&
+		inner->x + inner->width <= outer->x + outer->width &&
+		inner->y + inner->height <= outer->y + outer->height;
+}
+
+// how far a page's ink reaches past its text layout bounds on each side
+struct outsets_t {
+	int known;
+	double left, top, right, bottom;
+};
+
+#define SAMPLE_MARGIN 1.0 // points added to the outsets measured on the sample
+
+void add_outsets(struct outsets_t *outsets, cairo_rectangle_t *ink, cairo_rectangle_t *layout) {
+	if (ink->width == 0 && ink->height == 0) {
+		return;
+	}
+	double left = layout->x - ink->x;
+	double top = layout->y - ink->y;
+	double right = (ink->x + ink->width) - (layout->x + layout->width);
+	double bottom = (ink->y + ink->height) - (layout->y + layout->height);
+	if (!outsets->known) {
+		outsets->known = TRUE;
+		outsets->left = left;
+		outsets->top = top;
+		outsets->right = right;
+		outsets->bottom = bottom;
+		return;
+	}
+	outsets->left = fmax(outsets->left, left);
+	outsets->top = fmax(outsets->top, top);
+	outsets->right = fmax(outsets->right, right);
+	outsets->bottom = fmax(outsets->bottom, bottom);
+}
+
+// method: the pages are split into groups sharing a crop box (page_num %
+// ngroups) and only trim_sample pages spread evenly over each group are
+// drawn. The sample also gives how far ink reaches past the text layout
+// bounds. Every other page has its layout bounds grown by that much and is
+// only drawn when they then reach past the ink crop box built so far or it
+// has content the text layout does not cover.
+void add_sampled_cropboxes(struct pages_t *pages, int *crop_boxes, int ngroups) {
+	char *sampled = calloc(pages->npages, sizeof(char));
+	struct outsets_t *outsets = calloc(ngroups, sizeof(struct outsets_t));
+
+	progress_start(&pages->progress, "trim", "pages", pages->npages);
+	int done = 0;
+
+	int group;
+	for (group = 0; group < ngroups; group++) {
+		int members = (pages->npages - group + ngroups - 1) / ngroups;
+		int nsamples = pages->trim_sample < members ? pages->trim_sample : members;
+
+		// the middle page of each of nsamples equal strata
+		int stratum;
+		for (stratum = 0; stratum < nsamples; stratum++) {
+			int member = (int) ((long) (2 * stratum + 1) * members / (2 * nsamples));
+			int page_num = group + member * ngroups;
+			struct page_t *page = &pages->pages[page_num];
+
+			sampled[page_num] = TRUE;
+			pages->sampled_pages++;
+			page->crop_box = crop_boxes[group];
+			cairo_rectangle_t *ink_extents = page_ink_extents(pages, page);
+			add_to_crop_box(page_crop_box(pages, page), ink_extents);
+
+			cairo_rectangle_t layout_extents;
+			if (fast_ink_extents(pages, page, &layout_extents)) {
+				add_outsets(&outsets[group], ink_extents, &layout_extents);
+			}
+
+			progress_update(&pages->progress, ++done);
+		}
+	}
+
+	int page_num;
+	for (page_num = 0; page_num < pages->npages; page_num++) {
+		if (sampled[page_num]) {
+			continue;
+		}
+		struct page_t *page = &pages->pages[page_num];
+		group = page_num % ngroups;
+		page->crop_box = crop_boxes[group];
+
+		cairo_rectangle_t layout_extents;
+		int has_layout_extents = fast_ink_extents(pages, page, &layout_extents);
+		int contained = FALSE;
+		if (has_layout_extents && outsets[group].known) {
+			struct outsets_t *outset = &outsets[group];
+			cairo_rectangle_t estimate = layout_extents;
+			if (estimate.width != 0 || estimate.height != 0) {
+				estimate.x -= outset->left + SAMPLE_MARGIN;
+				estimate.y -= outset->top + SAMPLE_MARGIN;
+				estimate.width += outset->left + outset->right + 2 * SAMPLE_MARGIN;
+				estimate.height += outset->top + outset->bottom + 2 * SAMPLE_MARGIN;
+			}
+			contained = rectangle_contains(page_crop_box(pages, page), &estimate);
+		}
+		if (!contained) {
+			pages->escalated_pages++;
+			cairo_rectangle_t *ink_extents = page_ink_extents(pages, page);
+			add_to_crop_box(page_crop_box(pages, page), ink_extents);
+			if (has_layout_extents) {
+				add_outsets(&outsets[group], ink_extents, &layout_extents);
+			}
+		}
+
+		progress_update(&pages->progress, ++done);
+	}
+	progress_finish(&pages->progress);
+
+	free(outsets);
+	free(sampled);
 }
 
 void add_even_odd_cropboxes(PopplerDocument *document, struct pages_t *pages) {
-	cairo_rectangle_t *odd_page_crop_box = malloc(sizeof(cairo_rectangle_t));
-	cairo_rectangle_t *even_page_crop_box = malloc(sizeof(cairo_rectangle_t));
+	int odd_page_crop_box = new_crop_box(pages);
+	int even_page_crop_box = new_crop_box(pages);
+
+	if (pages->trim_sample > 0) {
+		int crop_boxes[2] = {odd_page_crop_box, even_page_crop_box};
+		add_sampled_cropboxes(pages, crop_boxes, 2);
+		return;
+	}
 
-	evenodd_cropboxes(document, odd_page_crop_box, even_page_crop_box);
+	progress_start(&pages->progress, "trim", "pages", pages->npages);
 
 	int page_num;
 	for (page_num = 0; page_num < pages->npages; page_num++) {
 		struct page_t *page = &pages->pages[page_num];
+		cairo_rectangle_t *extents = page_ink_extents(pages, page);
 
 		if (page_num % 2 == 1) {
 			page->crop_box = even_page_crop_box;
 		} else {
 			page->crop_box = odd_page_crop_box;
 		}
+		add_to_crop_box(page_crop_box(pages, page), extents);
+
+		progress_update(&pages->progress, page_num + 1);
 	}
+	progress_finish(&pages->progress);
 }
 
 void add_document_cropboxes(PopplerDocument *document, struct pages_t *pages) {
-	cairo_rectangle_t *crop_box = malloc(sizeof(cairo_rectangle_t));
-
-	GError *error = NULL;
-	int num_document_pages = poppler_document_get_n_pages(document);
-
-	cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	cairo_t *cr = cairo_create(surface);
-	int page_num;
-	for (page_num = 0; page_num < num_document_pages; page_num++) {
-		PopplerPage *page = poppler_document_get_page(document, page_num);
-		if (page == NULL) {
-			printf("%s:%d: %s\n", __FILE__, __LINE__, error->message);
-			exit(1);		
-		}
+	int crop_box = new_crop_box(pages);
 
-		poppler_page_render_for_printing(page, cr);
-		g_object_unref(page);
+	if (pages->trim_sample > 0) {
+		add_sampled_cropboxes(pages, &crop_box, 1);
+		return;
 	}
-	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
-	cairo_destroy(cr);
-
-	cairo_recording_surface_ink_extents(surface,
-		&crop_box->x,
-		&crop_box->y,
-		&crop_box->width,
-		&crop_box->height);
 
-	// use to check extent and crop box handling
-	// write_surface_to_file_showing_crop_box("document.pdf", surface, crop_box);
-
-	// cleanup surfaces used to get crop boxes
-	cairo_surface_destroy(surface);
-	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
+	progress_start(&pages->progress, "trim", "pages", pages->npages);
 
+	int page_num;
 	for (page_num = 0; page_num < pages->npages; page_num++) {
 		struct page_t *page = &pages->pages[page_num];
 		page->crop_box = crop_box;
+		add_to_crop_box(page_crop_box(pages, page), page_ink_extents(pages, page));
+
+		progress_update(&pages->progress, page_num + 1);
 	}
+	progress_finish(&pages->progress);
 }
 
 void add_per_page_cropboxes(PopplerDocument *document, struct pages_t *pages) {
-	GError *error = NULL;
-	int num_document_pages = poppler_document_get_n_pages(document);	
+	progress_start(&pages->progress, "trim", "pages", pages->npages);
 
 	int page_num;
 	for (page_num = 0; page_num < pages->npages; page_num++) {
-		int document_page_num = pages->pages[page_num].num;
-
-		printf("document_page_num: %d\n", document_page_num);
-
-		if (document_page_num >= num_document_pages) {
-			printf("ERROR: The document does not have page %d, it only has %d pages\n", document_page_num, num_document_pages);
-			exit(2);
-		}
-
-		cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
-		cairo_t *cr = cairo_create(surface);
-
-		PopplerPage *page = poppler_document_get_page(document, document_page_num);
-		if (page == NULL) {
-			printf("%s:%d: %s\n", __FILE__, __LINE__, error->message);
-			exit(1);		
-		}
-
-		poppler_page_render_for_printing(page, cr);
-		g_object_unref(page);
-
-		exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
-		cairo_destroy(cr);
-
-		cairo_rectangle_t *crop_box = malloc(sizeof(cairo_rectangle_t));
-		cairo_recording_surface_ink_extents(surface,
-			&crop_box->x,
-			&crop_box->y,
-			&crop_box->width,
-			&crop_box->height);
-
-		// use to check extent and crop box handling
-		// write_surface_to_file_showing_crop_box("per_page.pdf", surface, crop_box);
+		struct page_t *page = &pages->pages[page_num];
 
-		// cleanup surfaces used to get crop boxes
-		cairo_surface_destroy(surface);
-		exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
+		page->crop_box = new_crop_box(pages);
+		*page_crop_box(pages, page) = *page_ink_extents(pages, page);
 
-		pages->pages[page_num].crop_box = crop_box;
+		progress_update(&pages->progress, page_num + 1);
 	}
-}
\ No newline at end of file
+	progress_finish(&pages->progress);
+}
@@ -0,0 +1,501 @@
+#include "all.h"
+
+// method: after cairo has written the output, every image and embedded font
+// program is keyed by a hash of its dictionary and data. Objects with the same
+// content are replaced by references to the first copy and the file is written
+// again without them. Poppler hands cairo a new image surface every time a page
+// draws an image, so without this a logo on every page is stored once per page.
+
+void buffer_append(struct buffer_t *buffer, const void *data, size_t length) {
+	if (buffer->length + length > buffer->allocated) {
+		buffer->allocated = (buffer->length + length) * 2 + 64;
+		buffer->data = realloc(buffer->data, buffer->allocated);
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+void buffer_printf(struct buffer_t *buffer, const char *format, ...) {
+	char *text;
+	va_list args;
+	va_start(args, format);
+	int length = vasprintf(&text, format, args);
+	va_end(args);
+	if (length >= 0) {
+		buffer_append(buffer, text, length);
+		free(text);
+	}
+}
+
+struct dedup_t {
+	struct pdf_file_t *file;
+	int *canonical; // object each object is replaced with, itself if kept
+	int *candidates;
+	int ncandidates;
+	uint64_t *hashes; // indexed by object number
+};
+
+int dedup_canonical(struct dedup_t *dedup, int num) {
+	while (num > 0 && num < dedup->file->nobjects && dedup->canonical[num] != num) {
+		num = dedup->canonical[num];
+	}
+	return num;
+}
+
+// writes value with references replaced by their canonical objects
+void dedup_serialize(struct dedup_t *dedup, struct buffer_t *buffer, struct pdf_value_t *value, int top) {
+	int i;
+	switch (value->type) {
+	case pdf_null:
+		buffer_append(buffer, "null", 4);
+		break;
+	case pdf_bool:
+		if (value->number) {
+			buffer_append(buffer, "true", 4);
+		} else {
+			buffer_append(buffer, "false", 5);
+		}
+		break;
+	case pdf_number:
+		if (value->number == floor(value->number) && fabs(value->number) < 1e15) {
+			buffer_printf(buffer, "%.0f", value->number);
+		} else {
+			buffer_printf(buffer, "%.17g", value->number);
+		}
+		break;
+	case pdf_string:
+		buffer_append(buffer, "<", 1);
+		for (i = 0; i < value->length; i++) {
+			buffer_printf(buffer, "%02x", (unsigned char) value->string[i]);
+		}
+		buffer_append(buffer, ">", 1);
+		break;
+	case pdf_name:
+		buffer_printf(buffer, "/%s", value->string);
+		break;
+	case pdf_ref:
+		buffer_printf(buffer, "%d 0 R", dedup_canonical(dedup, value->num));
+		break;
+	case pdf_array:
+		buffer_append(buffer, "[", 1);
+		for (i = 0; i < value->length; i++) {
+			dedup_serialize(dedup, buffer, value->items[i], FALSE);
+			buffer_append(buffer, " ", 1);
+		}
+		buffer_append(buffer, "]", 1);
+		break;
+	case pdf_dict:
+	case pdf_stream:
+		buffer_append(buffer, "<<", 2);
+		for (i = 0; i < value->length; i++) {
+			// the length of equal streams is equal, it may be in different objects
+			if (top && strcmp(value->keys[i], "Length") == 0) {
+				continue;
+			}
+			buffer_printf(buffer, "/%s ", value->keys[i]);
+			dedup_serialize(dedup, buffer, value->items[i], FALSE);
+			buffer_append(buffer, " ", 1);
+		}
+		buffer_append(buffer, ">>", 2);
+		break;
+	}
+}
+
+// marks the font programs referenced from font descriptors anywhere in value
+void dedup_find_font_files(struct dedup_t *dedup, struct pdf_value_t *value, char *is_candidate) {
+	if (value == NULL) {
+		return;
+	}
+
+	int i;
+	for (i = 0; i < value->length && value->items != NULL; i++) {
+		struct pdf_value_t *item = value->items[i];
+		if (value->keys != NULL && strncmp(value->keys[i], "FontFile", 8) == 0
+				&& item->type == pdf_ref && item->num > 0 && item->num < dedup->file->nobjects) {
+			is_candidate[item->num] = TRUE;
+		}
+		dedup_find_font_files(dedup, item, is_candidate);
+	}
+}
+
+// objects are sorted by key, then number, with the key kept next to the
+// number so the comparison needs nothing else and threads can sort at once
+struct sort_key_t {
+	uint64_t key;
+	int num;
+};
+
+int compare_sort_keys(const void *a, const void *b) {
+	const struct sort_key_t *key_a = a;
+	const struct sort_key_t *key_b = b;
+	if (key_a->key != key_b->key) {
+		return key_a->key < key_b->key ? -1 : 1;
+	}
+	return key_a->num - key_b->num;
+}
+
+// sorts the object numbers in nums by keys[num]
+void sort_by_key(int *nums, int n, const uint64_t *keys) {
+	struct sort_key_t *sorted = malloc(sizeof(struct sort_key_t) * (n > 0 ? n : 1));
+	int i;
+	for (i = 0; i < n; i++) {
+		sorted[i].key = keys[nums[i]];
+		sorted[i].num = nums[i];
+	}
+	qsort(sorted, n, sizeof(struct sort_key_t), compare_sort_keys);
+	for (i = 0; i < n; i++) {
+		nums[i] = sorted[i].num;
+	}
+	free(sorted);
+}
+
+uint64_t dedup_hash(struct dedup_t *dedup, int num, struct buffer_t *dict) {
+	struct pdf_value_t *value = pdf_get_object(dedup->file, num);
+	dict->length = 0;
+	dedup_serialize(dedup, dict, value, TRUE);
+	uint64_t hash = hash_bytes(HASH_SEED, dict->data, dict->length);
+	return hash_bytes(hash, value->stream, value->stream_length);
+}
+
+int dedup_equal(struct dedup_t *dedup, int a, int b) {
+	struct pdf_value_t *value_a = pdf_get_object(dedup->file, a);
+	struct pdf_value_t *value_b = pdf_get_object(dedup->file, b);
+	if (value_a->stream_length != value_b->stream_length
+			|| memcmp(value_a->stream, value_b->stream, value_a->stream_length) != 0) {
+		return FALSE;
+	}
+
+	struct buffer_t dict_a = {NULL, 0, 0};
+	struct buffer_t dict_b = {NULL, 0, 0};
+	dedup_serialize(dedup, &dict_a, value_a, TRUE);
+	dedup_serialize(dedup, &dict_b, value_b, TRUE);
+	int equal = dict_a.length == dict_b.length && memcmp(dict_a.data, dict_b.data, dict_a.length) == 0;
+	free(dict_a.data);
+	free(dict_b.data);
+	return equal;
+}
+
+// one round of merging equal candidates, returns how many were merged
+// merging soft masks can make the images using them equal, so this is repeated
+int dedup_merge(struct dedup_t *dedup) {
+	struct buffer_t dict = {NULL, 0, 0};
+	int i;
+	for (i = 0; i < dedup->ncandidates; i++) {
+		int num = dedup->candidates[i];
+		dedup->hashes[num] = dedup_hash(dedup, num, &dict);
+	}
+	free(dict.data);
+
+	sort_by_key(dedup->candidates, dedup->ncandidates, dedup->hashes);
+
+	int merged = 0;
+	int run_start = 0;
+	for (i = 1; i <= dedup->ncandidates; i++) {
+		if (i < dedup->ncandidates && dedup->hashes[dedup->candidates[i]] == dedup->hashes[dedup->candidates[run_start]]) {
+			continue;
+		}
+
+		// candidates run_start..i-1 share a hash, compare them for real
+		int a, b;
+		for (a = run_start; a < i; a++) {
+			int num_a = dedup->candidates[a];
+			if (dedup->canonical[num_a] != num_a) {
+				continue;
+			}
+			for (b = a + 1; b < i; b++) {
+				int num_b = dedup->candidates[b];
+				if (dedup->canonical[num_b] == num_b && dedup_equal(dedup, num_a, num_b)) {
+					dedup->canonical[num_b] = num_a;
+					merged++;
+				}
+			}
+		}
+		run_start = i;
+	}
+
+	// merged objects are no longer candidates
+	int kept = 0;
+	for (i = 0; i < dedup->ncandidates; i++) {
+		int num = dedup->candidates[i];
+		if (dedup->canonical[num] == num) {
+			dedup->candidates[kept++] = num;
+		}
+	}
+	dedup->ncandidates = kept;
+
+	return merged;
+}
+
+// copies data[start, end) to output, replacing references to merged objects
+void dedup_copy(struct dedup_t *dedup, struct buffer_t *output, size_t start, size_t end) {
+	const unsigned char *data = dedup->file->data;
+	struct pdf_lexer_t lexer = {data, start, end};
+	struct pdf_token_t token;
+	size_t copied = start;
+
+	while (pdf_next_token(&lexer, &token)) {
+		if (!pdf_token_is_integer(&token)) {
+			continue;
+		}
+
+		size_t saved = lexer.pos;
+		struct pdf_token_t gen, r;
+		if (pdf_next_token(&lexer, &gen) && pdf_token_is_integer(&gen)
+				&& pdf_next_token(&lexer, &r) && pdf_token_is(&r, "R")) {
+			int num = (int) pdf_token_number(&token);
+			int canonical = dedup_canonical(dedup, num);
+			if (canonical != num) {
+				buffer_append(output, data + copied, token.start - (data + copied));
+				buffer_printf(output, "%d %d R", canonical, dedup->file->xref[canonical].gen);
+				copied = r.start + r.length - data;
+			}
+		} else {
+			lexer.pos = saved;
+		}
+	}
+
+	buffer_append(output, data + copied, end - copied);
+}
+
+int dedup_write(struct dedup_t *dedup, struct buffer_t *output) {
+	struct pdf_file_t *file = dedup->file;
+
+	// objects are written in the order they had in the file
+	int *order = malloc(sizeof(int) * file->nobjects);
+	uint64_t *offsets_in = malloc(sizeof(uint64_t) * file->nobjects);
+	int nordered = 0;
+	int num;
+	for (num = 1; num < file->nobjects; num++) {
+		if (file->xref[num].type == 'n' && file->objects[num] != NULL) {
+			order[nordered++] = num;
+			offsets_in[num] = file->xref[num].offset;
+		}
+	}
+	if (nordered == 0) {
+		free(offsets_in);
+		free(order);
+		return FALSE;
+	}
+	sort_by_key(order, nordered, offsets_in);
+	free(offsets_in);
+
+	// header and binary comment
+	buffer_append(output, file->data, file->xref[order[0]].offset);
+
+	long *offsets = calloc(file->nobjects, sizeof(long));
+	int i;
+	for (i = 0; i < nordered; i++) {
+		num = order[i];
+		if (dedup->canonical[num] != num) {
+			continue;
+		}
+
+		struct pdf_xref_t *entry = &file->xref[num];
+		struct pdf_value_t *value = file->objects[num];
+		offsets[num] = output->length;
+		if (value->type == pdf_stream) {
+			size_t stream_start = value->stream - file->data;
+			dedup_copy(dedup, output, entry->offset, stream_start);
+			buffer_append(output, value->stream, entry->end - stream_start);
+		} else {
+			dedup_copy(dedup, output, entry->offset, entry->end);
+		}
+		buffer_append(output, "\n", 1);
+	}
+	free(order);
+
+	// free entries form a list starting at object 0
+	long xref_offset = output->length;
+	int size = pdf_integer(file, pdf_dict_get(file->trailer, "Size"), file->nobjects);
+	if (size > file->nobjects) {
+		size = file->nobjects;
+	}
+	buffer_printf(output, "xref\n0 %d\n", size);
+	for (num = 0; num < size; num++) {
+		if (offsets[num] > 0) {
+			buffer_printf(output, "%010ld %05d n \n", offsets[num], file->xref[num].gen);
+			continue;
+		}
+
+		int next_free = 0;
+		int next;
+		for (next = num + 1; next < size; next++) {
+			if (offsets[next] == 0) {
+				next_free = next;
+				break;
+			}
+		}
+		// removed objects get a new generation
+		int gen = file->xref[num].gen;
+		if (num == 0) {
+			gen = 65535;
+		} else if (file->xref[num].type != 'f') {
+			gen++;
+		}
+		buffer_printf(output, "%010d %05d f \n", next_free, gen);
+	}
+	free(offsets);
+
+	buffer_printf(output, "trailer\n<< /Size %d ", size);
+	for (i = 0; i < file->trailer->length; i++) {
+		const char *key = file->trailer->keys[i];
+		if (strcmp(key, "Size") == 0 || strcmp(key, "Prev") == 0) {
+			continue;
+		}
+		buffer_printf(output, "/%s ", key);
+		dedup_serialize(dedup, output, file->trailer->items[i], FALSE);
+		buffer_append(output, " ", 1);
+	}
+	buffer_printf(output, ">>\nstartxref\n%ld\n%%%%EOF\n", xref_offset);
+
+	return TRUE;
+}
+
+// deduplicates images and font programs of file into output
+// returns FALSE and leaves output alone if it has nothing to deduplicate or
+// uses features this does not handle
+int dedup_pdf(struct pdf_file_t *file, struct buffer_t *output, struct dedup_stats_t *stats) {
+	stats->objects = 0;
+	stats->bytes = 0;
+
+	// objects inside object streams would need the object streams rewritten
+	int num;
+	int ok = !file->has_xref_stream;
+	for (num = 1; ok && num < file->nobjects; num++) {
+		if (file->xref[num].type == 'c') {
+			ok = FALSE;
+		} else if (file->xref[num].type == 'n' && pdf_get_object(file, num) == NULL) {
+			ok = FALSE;
+		}
+	}
+	if (!ok) {
+		return FALSE;
+	}
+
+	struct dedup_t dedup;
+	dedup.file = file;
+	dedup.canonical = malloc(sizeof(int) * file->nobjects);
+	dedup.candidates = malloc(sizeof(int) * file->nobjects);
+	dedup.hashes = calloc(file->nobjects, sizeof(uint64_t));
+	dedup.ncandidates = 0;
+
+	char *is_candidate = calloc(file->nobjects, 1);
+	for (num = 0; num < file->nobjects; num++) {
+		dedup.canonical[num] = num;
+		struct pdf_value_t *value = file->objects[num];
+		if (value == NULL) {
+			continue;
+		}
+		if (value->type == pdf_stream && pdf_is_name(pdf_dict_get(value, "Subtype"), "Image")) {
+			is_candidate[num] = TRUE;
+		}
+		dedup_find_font_files(&dedup, value, is_candidate);
+	}
+	for (num = 0; num < file->nobjects; num++) {
+		if (is_candidate[num] && file->objects[num] != NULL && file->objects[num]->type == pdf_stream) {
+			dedup.candidates[dedup.ncandidates++] = num;
+		}
+	}
+	free(is_candidate);
+
+	int merged;
+	do {
+		merged = dedup_merge(&dedup);
+		stats->objects += merged;
+	} while (merged > 0);
+
+	int written = FALSE;
+	if (stats->objects > 0) {
+		for (num = 1; num < file->nobjects; num++) {
+			if (dedup.canonical[num] != num) {
+				stats->bytes += file->xref[num].end - file->xref[num].offset;
+			}
+		}
+		written = dedup_write(&dedup, output);
+	}
+
+	free(dedup.canonical);
+	free(dedup.candidates);
+	free(dedup.hashes);
+
+	if (!written) {
+		stats->objects = 0;
+		stats->bytes = 0;
+	}
+	return written;
+}
+
+// deduplicates the pdf in data into output, see dedup_pdf
+int dedup_data(const unsigned char *data, size_t size, struct buffer_t *output, struct dedup_stats_t *stats) {
+	stats->objects = 0;
+	stats->bytes = 0;
+
+	struct pdf_file_t *file = pdf_file_open_data(data, size);
+	if (file == NULL) {
+		return FALSE;
+	}
+	int written = dedup_pdf(file, output, stats);
+	pdf_file_free(file);
+	return written;
+}
+
+// deduplicates images and font programs in the pdf file filename in place
+// leaves the file alone if it has nothing to deduplicate or uses features
+// this does not handle, returns why if the file could not be read or
+// rewritten, NULL otherwise
+char* dedup_file(char *filename, struct dedup_stats_t *stats) {
+	stats->objects = 0;
+	stats->bytes = 0;
+
+	struct pdf_file_t *file = pdf_file_open(filename);
+	if (file == NULL) {
+		char *error;
+		asprintf(&error, "could not read %s", filename);
+		return error;
+	}
+
+	struct buffer_t output = {NULL, 0, 0};
+	int written = dedup_pdf(file, &output, stats);
+	pdf_file_free(file);
+	if (!written) {
+		free(output.data);
+		return NULL;
+	}
+
+	// write next to the original and replace it once complete
+	char *error = NULL;
+	char *temporary;
+	asprintf(&temporary, "%s.XXXXXX", filename);
+	int fd = mkstemp(temporary);
+	if (fd == -1) {
+		asprintf(&error, "could not create %s: %s", temporary, strerror(errno));
+	} else {
+		struct stat filestat;
+		if (stat(filename, &filestat) == 0) {
+			fchmod(fd, filestat.st_mode & 07777);
+		}
+		FILE *stream = fdopen(fd, "wb");
+		if (stream == NULL) {
+			asprintf(&error, "could not write %s: %s", temporary, strerror(errno));
+			close(fd);
+		} else {
+			int ok = fwrite(output.data, 1, output.length, stream) == output.length;
+			if (fclose(stream) != 0 || !ok) {
+				asprintf(&error, "could not write %s: %s", temporary, strerror(errno));
+			} else if (rename(temporary, filename) == -1) {
+				asprintf(&error, "could not replace %s: %s", filename, strerror(errno));
+			}
+		}
+		if (error != NULL) {
+			unlink(temporary);
+		}
+	}
+	free(temporary);
+	free(output.data);
+
+	if (error != NULL) {
+		stats->objects = 0;
+		stats->bytes = 0;
+	}
+	return error;
+}
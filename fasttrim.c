@@ -0,0 +1,167 @@
+#include "all.h"
+
+// method: a page that only shows text and images has its ink where poppler's
+// text layout and image mapping put the glyphs and images, so it does not
+// need to be drawn. Glyph boxes include the font's ascent and descent, so
+// crop boxes can be slightly larger than drawing the page would find.
+// Pages that paint paths or shadings, use forms, inline images, Type 3 fonts,
+// whose glyphs are drawn with paths of any size, invisible text or
+// annotations, or are rotated are drawn as before. Poppler is only asked for
+// the text layout of pages showing text and for the images of pages with
+// images.
+
+// returns TRUE if the content stream only shows text and images
+// has_text and has_images are set to whether it shows any
+int content_is_text_and_images(struct pdf_file_t *pdf, struct pdf_value_t *page, unsigned char *content, size_t length,
+	int *has_text, int *has_images) {
+	static const char *painting_operators[] = {"S", "s", "f", "F", "f*", "B", "B*", "b", "b*", "sh", NULL};
+	static const char *text_operators[] = {"Tj", "TJ", "'", "\"", NULL};
+
+	struct pdf_value_t *resources = pdf_page_attribute(pdf, page, "Resources");
+	struct pdf_value_t *xobjects = pdf_dict_resolve(pdf, resources, "XObject");
+
+	struct pdf_value_t *fonts = pdf_dict_resolve(pdf, resources, "Font");
+	if (fonts != NULL && fonts->type == pdf_dict) {
+		int i;
+		for (i = 0; i < fonts->length; i++) {
+			struct pdf_value_t *font = pdf_resolve(pdf, fonts->items[i]);
+			if (font != NULL && pdf_is_name(pdf_dict_get(font, "Subtype"), "Type3")) {
+				return FALSE;
+			}
+		}
+	}
+
+	*has_text = FALSE;
+	*has_images = FALSE;
+
+	struct pdf_lexer_t lexer = {content, 0, length};
+	struct pdf_token_t token;
+	struct pdf_token_t previous = {token_eof, content, 0};
+	while (pdf_next_token(&lexer, &token)) {
+		if (token.type != token_keyword) {
+			previous = token;
+			continue;
+		}
+
+		int i;
+		for (i = 0; painting_operators[i] != NULL; i++) {
+			if (pdf_token_is(&token, painting_operators[i])) {
+				return FALSE;
+			}
+		}
+
+		for (i = 0; text_operators[i] != NULL; i++) {
+			if (pdf_token_is(&token, text_operators[i])) {
+				*has_text = TRUE;
+			}
+		}
+
+		if (pdf_token_is(&token, "BI")) {
+			// not in poppler's image mapping
+			return FALSE;
+		} else if (pdf_token_is(&token, "Do")) {
+			if (previous.type != token_name) {
+				return FALSE;
+			}
+			char *name = pdf_decode_name(&previous);
+			struct pdf_value_t *xobject = pdf_dict_resolve(pdf, xobjects, name);
+			free(name);
+			if (xobject == NULL || !pdf_is_name(pdf_dict_get(xobject, "Subtype"), "Image")) {
+				return FALSE;
+			}
+			*has_images = TRUE;
+		} else if (pdf_token_is(&token, "Tr")) {
+			// invisible and clipping only text has no ink
+			int mode = (int) pdf_token_number(&previous);
+			if (previous.type != token_number || mode == 3 || mode == 7) {
+				return FALSE;
+			}
+		}
+		previous = token;
+	}
+	return TRUE;
+}
+
+void add_poppler_rectangle(cairo_rectangle_t *extents, PopplerRectangle *rectangle) {
+	cairo_rectangle_t area;
+	area.x = fmin(rectangle->x1, rectangle->x2);
+	area.y = fmin(rectangle->y1, rectangle->y2);
+	area.width = fabs(rectangle->x2 - rectangle->x1);
+	area.height = fabs(rectangle->y2 - rectangle->y1);
+	if (area.width > 0 && area.height > 0) {
+		add_to_crop_box(extents, &area);
+	}
+}
+
+// finds the ink extents of the page without drawing it
+// returns FALSE if the page has content this can not account for
+int fast_ink_extents(struct pages_t *pages, struct page_t *page, cairo_rectangle_t *extents) {
+	struct pdf_file_t *pdf = pages->pdf;
+	if (pdf == NULL || pdf_page_count(pdf) != pages->pool->npages) {
+		return FALSE;
+	}
+
+	struct pdf_value_t *page_dict = pdf_page(pdf, page->num);
+	if (page_dict == NULL) {
+		return FALSE;
+	}
+
+	// annotations are drawn when printing, text and images of rotated pages
+	// are not reported in the coordinates the page is drawn in
+	struct pdf_value_t *annots = pdf_dict_resolve(pdf, page_dict, "Annots");
+	if (annots != NULL && annots->type == pdf_array && annots->length > 0) {
+		return FALSE;
+	}
+	if (pdf_integer(pdf, pdf_page_attribute(pdf, page_dict, "Rotate"), 0) % 360 != 0) {
+		return FALSE;
+	}
+
+	size_t length;
+	unsigned char *content = pdf_page_contents(pdf, page_dict, &length);
+	if (content == NULL) {
+		return FALSE;
+	}
+	int has_text, has_images;
+	int text_and_images = content_is_text_and_images(pdf, page_dict, content, length, &has_text, &has_images);
+	free(content);
+	if (!text_and_images) {
+		return FALSE;
+	}
+
+	cairo_rectangle_t found = {0, 0, 0, 0};
+	if (!has_text && !has_images) {
+		*extents = found;
+		return TRUE;
+	}
+	PopplerPage *poppler_page = page_pool_get(pages->pool, page->num);
+
+	// one rectangle per character of the page text, whitespace has no ink
+	char *text = has_text ? poppler_page_get_text(poppler_page) : NULL;
+	PopplerRectangle *rectangles;
+	guint nrectangles;
+	if (text != NULL && poppler_page_get_text_layout(poppler_page, &rectangles, &nrectangles)) {
+		const char *c = text;
+		guint i;
+		for (i = 0; i < nrectangles && *c != 0; i++, c = g_utf8_next_char(c)) {
+			if (!g_unichar_isspace(g_utf8_get_char(c))) {
+				add_poppler_rectangle(&found, &rectangles[i]);
+			}
+		}
+		g_free(rectangles);
+	}
+	g_free(text);
+
+	if (has_images) {
+		GList *images = poppler_page_get_image_mapping(poppler_page);
+		GList *image;
+		for (image = images; image != NULL; image = image->next) {
+			add_poppler_rectangle(&found, &((PopplerImageMapping*) image->data)->area);
+		}
+		poppler_page_free_image_mapping(images);
+	}
+
+	page_pool_put(pages->pool, page->num);
+
+	*extents = found;
+	return TRUE;
+}
@@ -9,7 +9,100 @@ int get_num_pages_to_layout(int npages) {
 	return num_pages_to_layout;
 }
 
+// the page of the input shown as page_to_layout on the output
+int layout_page_num(int page_to_layout, int num_pages_to_layout, struct options_t options) {
+	int page_num;
+	switch (options.type) {
+	case chapbook:
+		page_num = page_to_layout/2;
+		if (page_to_layout%2 == 1) {
+			// even pages, verso
+			page_num = num_pages_to_layout-page_num-1;
+		}
+		break;
+	case perfect:
+		page_num = page_to_layout - 1;
+		if (page_to_layout%4 == 0) {
+			page_num += 4;
+		}
+		break;
+	default:
+		NOT_IMPLEMENTED();
+	}
+	return page_num;
+}
+
+// places a drawing of the page, clipped to the crop box
+void draw_recording(cairo_surface_t *recording, cairo_rectangle_t *crop_box, cairo_t *cr) {
+	if (crop_box->width <= 0 || crop_box->height <= 0) {
+		// nothing to draw on a blank page
+		return;
+	}
+
+	cairo_surface_t *cropped = cairo_surface_create_for_rectangle(recording,
+		crop_box->x, crop_box->y, crop_box->width, crop_box->height);
+	exit_if_cairo_surface_status_not_success(cropped, __FILE__, __LINE__);
+
+	cairo_set_source_surface(cr, cropped, crop_box->x, crop_box->y);
+	cairo_paint(cr);
+
+	cairo_surface_destroy(cropped);
+}
+
+// draws document page num in page coordinates
+// the render engine has poppler draw the page again, the xobject engine
+// places a recording, kept from trimming when the memory budget allows, which
+// the pdf surface writes as a form xobject clipped to the crop box
+// scanned pages are drawn without decoding their images by either engine
+// pages recorded by other threads and scans converted to gray or black and
+// white are placed like the xobject engine does
+void draw_page(struct pages_t *pages, int num, cairo_rectangle_t *crop_box, cairo_t *cr, struct options_t options) {
+	cairo_surface_t *recording = take_recording(pages, num);
+	if (recording == NULL && pages->color != color_keep) {
+		recording = color_page_recording(pages, num);
+	}
+	if (recording != NULL) {
+		draw_recording(recording, crop_box, cr);
+		cairo_surface_destroy(recording);
+		return;
+	}
+
+	if (draw_passthrough_page(pages, num, cr)) {
+		return;
+	}
+
+	switch (options.engine) {
+	case render: {
+		PopplerPage *page = page_pool_get(pages->pool, num);
+		poppler_page_render_for_printing(page, cr);
+		page_pool_put(pages->pool, num);
+		break;
+	}
+	case xobject:
+		if (crop_box->width > 0 && crop_box->height > 0) {
+			draw_recording(page_pool_get_recording(pages->pool, num), crop_box, cr);
+		}
+		break;
+	default:
+		NOT_IMPLEMENTED();
+	}
+}
+
 void layout(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options) {
+	int num_pages_to_layout = get_num_pages_to_layout(pages->npages);
+
+	progress_start(&pages->progress, "layout", "sheets", num_pages_to_layout/4);
+	if (pages->workers != NULL) {
+		layout_in_parallel(surface, cr, pages, options);
+	} else {
+		layout_sheets(surface, cr, pages, options, 0, num_pages_to_layout/4);
+	}
+	progress_finish(&pages->progress);
+}
+
+// lays out nsheets sheets starting at first_sheet
+// every sheet is two output pages and leaves cr as it found it
+void layout_sheets(cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options, int first_sheet, int nsheets) {
 	const double MARGIN = 15; // unprintable margin
 	const double GUTTER = 36; // interior margin
 
@@ -19,33 +112,16 @@ void layout(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, st
 
 	// figure out how many pages to layout
 	int num_pages_to_layout = get_num_pages_to_layout(pages->npages);
-	int num_document_pages = poppler_document_get_n_pages(document);
+	int num_document_pages = pages->pool->npages;
 
 	// layout the pages on the paper
 	int show_page = FALSE;
 	int page_to_layout;
-	for (page_to_layout = 0; page_to_layout < num_pages_to_layout; page_to_layout++) {
+	for (page_to_layout = first_sheet*4; page_to_layout < (first_sheet + nsheets)*4; page_to_layout++) {
 		cairo_save(cr);
 
 		// figure out the real page number
-		int page_num;
-		switch (options.type) {
-		case chapbook:
-			page_num = page_to_layout/2;
-			if (page_to_layout%2 == 1) {
-				// even pages, verso
-				page_num = num_pages_to_layout-page_num-1;
-			}
-			break;
-		case perfect:
-			page_num = page_to_layout - 1;
-			if (page_to_layout%4 == 0) {
-				page_num += 4;
-			}
-			break;
-		default:
-			NOT_IMPLEMENTED();
-		}
+		int page_num = layout_page_num(page_to_layout, num_pages_to_layout, options);
 
 		if (page_num >= pages->npages) {
 			// blank page, don't try to render it
@@ -66,13 +142,8 @@ void layout(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, st
 			is_recto = FALSE;
 		}
 
-		cairo_rectangle_t *crop_box = page_info->crop_box;
-
-		PopplerPage *page = poppler_document_get_page(document, page_info->num);
-		if (page == NULL) {
-			printf("%s:%d\n", __FILE__, __LINE__);
-			exit(1);
-		}
+		wait_for_trim(pages, page_info);
+		cairo_rectangle_t *crop_box = page_crop_box(pages, page_info);
 
 		// figure out the desired placement
 		double X = 0;
@@ -116,7 +187,10 @@ void layout(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, st
 		cairo_translate(cr, horizontal_offset, vertical_offset);
 		cairo_scale(cr, scale_factor, scale_factor);
 
-		poppler_page_render_for_printing(page, cr);
+		draw_page(pages, page_info->num, crop_box, cr, options);
+
+		// every page is laid out once, its recording is not needed anymore
+		page_pool_drop_recording(pages->pool, page_info->num);
 
 		// draw the crop box around the page
 #ifdef DISPLAY_BOXES
@@ -126,8 +200,6 @@ void layout(PopplerDocument *document, cairo_surface_t* surface, cairo_t *cr, st
 		cairo_set_source_rgb(cr, 0, 0, 0);
 #endif
 
-		g_object_unref(page);
-
 FINISH_LAYOUT:
 		cairo_restore(cr);
 
@@ -169,5 +241,10 @@ FINISH_LAYOUT:
 			cairo_translate(cr, -options.paper_width, -options.paper_height);
 		}
 		show_page = !show_page;
+
+		// both sides of a sheet are done after every fourth page
+		if (page_to_layout%4 == 3) {
+			progress_update(&pages->progress, (page_to_layout+1)/4);
+		}
 	}
 }
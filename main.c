@@ -1,23 +1,103 @@
 #include "all.h"
 
-double starttime(char* message) {
-	clock_t start = clock();
-	printf("%s ", message);
-	fflush(stdout);
-	return start;
-}
+struct output_t {
+	FILE *file;
+	enum sync_t sync;
+	size_t unsynced; // bytes written since the last sync
+};
+
+int write_to_file(void *closure, const unsigned char *data, unsigned int length) {
+	struct output_t *output = closure;
+	size_t written = fwrite(data, sizeof(unsigned char), length, output->file);
+	if (written != length) {
+		return 1;
+	}
 
-void finishtime(clock_t start) {
-	printf("%fs\n", (double)(clock() - start)/CLOCKS_PER_SEC);
-	fflush(stdout);
+	// keep the book from piling up in the page cache, like writing with O_DIRECT
+	output->unsynced += length;
+	if (output->sync == sync_chunks && output->unsynced >= WRITE_BUFFER_SIZE) {
+		int fd = fileno(output->file);
+		if (fflush(output->file) != 0 || fdatasync(fd) != 0) {
+			return 1;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		output->unsynced = 0;
+	}
+	return 0;
 }
 
-cairo_status_t write_surface_to_stream(void *closure, const unsigned char *data, unsigned int length) {
-	size_t written = fwrite(data, sizeof(unsigned char), length, (FILE*) closure);	
-	if (written != length) {
-		return CAIRO_STATUS_WRITE_ERROR;
+// makes the book of a job, returns FALSE if the job failed
+// books are written under a temporary name and renamed once they are complete
+int make_output(struct bookmaker_t *job, struct options_t options) {
+	if (options.print) {
+		// if sending to a printer instead of a file, we can generate ps directly
+		char* lpr_command;
+		asprintf(&lpr_command, "lp %s %s -o sides=two-sided-long-edge -o landscape -",
+			options.printer != NULL? "-d": "",
+			options.printer != NULL? options.printer:"");
+		struct output_t output = {popen(lpr_command, "w"), sync_none, 0};
+		// output.file = popen("cat - > book.ps", "w"); // for testing
+		free(lpr_command);
+
+		int ok = bookmaker_run(job, write_to_file, &output);
+		printf("Sending document to printer\n");
+		pclose(output.file);
+		return ok;
 	}
-	return CAIRO_STATUS_SUCCESS;
+
+	if (options.split > 0) {
+		// split books write their parts themselves
+		return bookmaker_run(job, write_to_file, NULL);
+	}
+
+	char *temporary_filename;
+	asprintf(&temporary_filename, "%s.tmp", options.output_filename);
+	struct output_t output = {fopen(temporary_filename, "wb"), options.sync, 0};
+	if (output.file == NULL) {
+		printf("Could not write %s: %s\n", temporary_filename, strerror(errno));
+		exit(1);
+	}
+
+	int ok = bookmaker_run(job, write_to_file, &output);
+	// the book is on disk before it replaces the previous one
+	if (ok && options.sync != sync_none && (fflush(output.file) != 0 || fsync(fileno(output.file)) != 0)) {
+		printf("Could not write %s: %s\n", temporary_filename, strerror(errno));
+		exit(1);
+	}
+	if (fclose(output.file) != 0) {
+		printf("Could not write %s: %s\n", temporary_filename, strerror(errno));
+		exit(1);
+	}
+	// rewriting the file keeps the book out of memory while it is laid out
+	if (ok && options.dedup) {
+		double start = stage_start("Deduplicating resources");
+		struct dedup_stats_t stats;
+		char *error = dedup_file(temporary_filename, &stats);
+		stage_finish(start, &job->timings.dedup);
+		if (error != NULL) {
+			// the book is complete, only larger than it could be
+			printf("Could not deduplicate the book, it is kept as it was: %s\n", error);
+			free(error);
+		} else {
+			printf("Removed %d duplicate images and fonts (%zu bytes)\n", stats.objects, stats.bytes);
+		}
+
+		// the rewritten file is synced like the book was
+		int fd = options.sync != sync_none ? open(temporary_filename, O_RDONLY) : -1;
+		if (fd != -1) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+	if (ok && rename(temporary_filename, options.output_filename) == -1) {
+		printf("Could not write %s: %s\n", options.output_filename, strerror(errno));
+		exit(1);
+	}
+	if (!ok) {
+		unlink(temporary_filename);
+	}
+	free(temporary_filename);
+	return ok;
 }
 
 int main(int argc, char** argv) {
@@ -48,89 +128,35 @@ int main(int argc, char** argv) {
 	}
 	printf(" paper\n");
 
-	clock_t start = starttime("Inspecting PDF");
-
-	switch (options.paper) {
-	case a4:
-		// 1 pt = 1/27 in
-		// 1 in = 2.54 cm
-		// A4 210x297mm = 595.224x841.824 
-		options.paper_height = 595.224;
-		options.paper_width = 841.824;
-		break;
-	case letter:
-		// LETTER 8.5x11in = 612x792
-		options.paper_height = 612;
-		options.paper_width = 792;
-		break;
-	default:
-		NOT_IMPLEMENTED();
+	// watching keeps the trim of the pages between runs
+	struct trim_cache_t *trim_cache = options.watch ? trim_cache_new() : NULL;
+	// changes made while the book is made are noticed by the next wait
+	struct watcher_t *watcher = options.watch ? watcher_new(options.input_filename) : NULL;
+
+	int status = 0;
+	for (;;) {
+		// the command line is a job that exits when it fails, unless watching
+		struct bookmaker_t *job = bookmaker_new_with_options(options);
+		job->watch = options.watch;
+		job->dedups_file = TRUE;
+		job->trim_cache = trim_cache;
+
+		if (!bookmaker_open_file(job, options.input_filename) || !make_output(job, options)) {
+			printf("\n%s\n", bookmaker_error(job));
+		} else if (options.verify && !verify_book(job)) {
+			status = 1;
+		}
+		bookmaker_free(job);
+
+		if (!options.watch) {
+			break;
+		}
+		printf("Watching %s for changes\n", options.input_filename);
+		wait_for_change(watcher);
 	}
 
-	// create the input and output documents
-	PopplerDocument *popplerDocument = open_document(options.input_filename);
-	cairo_surface_t *surface;
-	FILE *lpr;
-	if (options.print) {
-		// if sending to a printer instead of a file, we can generate ps directly
-		char* lpr_command;
-		asprintf(&lpr_command, "lp %s %s -o sides=two-sided-long-edge -o landscape -",
-			options.printer != NULL? "-d": "",
-			options.printer != NULL? options.printer:"");
-		lpr = popen(lpr_command, "w");
-		// lpr = popen("cat - > book.ps", "w"); // for testing
-		surface = cairo_ps_surface_create_for_stream(write_surface_to_stream, lpr, options.paper_width, options.paper_height);
-		free(lpr_command);
-	} else {
-		surface = cairo_pdf_surface_create(options.output_filename, options.paper_width, options.paper_height);
-	}
-	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
-	cairo_t *cr = cairo_create(surface);
-	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
-
-	// figure out which pages to layout
-	struct pages_t *pages = all_pages(popplerDocument, options);
-
-	// get the crop boxes for the pages
-	switch (options.trim) {
-	case even_odd:
-		add_even_odd_cropboxes(popplerDocument, pages);
-		break;
-	case document:
-		add_document_cropboxes(popplerDocument, pages);
-		break;
-	case per_page:
-		add_per_page_cropboxes(popplerDocument, pages);
-		break;
-	default:
-		NOT_IMPLEMENTED();
-	}
-	finishtime(start);
-
-	start = starttime("Creating Book");
-
-	if (options.add_cover) {
-		add_cover(popplerDocument, surface, cr, pages, options);
-	}
-
-	// layout the pages
-	layout(popplerDocument, surface, cr, pages, options);
-
-	// cleanup and finish
-	g_object_unref(popplerDocument);
-
-	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
-	cairo_destroy(cr);
-
-	cairo_surface_destroy(surface);
-	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
-	finishtime(start);
-
-	if(options.print) {
-		printf("Sending document to printer\n");
-		pclose(lpr);
-	}
+	free(options.output_filename);
 
 	printf("Done\n");
-	return 0;
+	return status;
 }
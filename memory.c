@@ -0,0 +1,106 @@
+#include "all.h"
+
+// method: the memory that grows with the document is accounted against
+// --max-memory: recordings of pages, the book when it is kept for
+// deduplication, the pages threads draw at the same time, the document, page
+// pool and pdf reader every thread other than the main one opens, the images
+// pages are converted in and the write buffers. Sizes of recordings are
+// estimated before drawing from the size of the content and the pixels of
+// the images of the page, documents from the size of the input. Once the
+// budget is used up, the recordings made while trimming are no longer kept
+// for the layout, which draws those pages again from the input, fewer sheets
+// are recorded ahead, and fewer threads are started. Recordings are dropped,
+// not written to disk. Not accounted are the document of the main thread and
+// what poppler and cairo keep while drawing and writing, e.g. fonts.
+
+#define RECORDING_OVERHEAD (64*1024) // a recording of an empty page
+#define RECORDING_CONTENT_FACTOR 4 // recorded commands per byte of content
+#define DOCUMENT_OVERHEAD (4*1024*1024) // a document and page pool of an empty input
+#define DOCUMENT_INPUT_FACTOR 2 // objects parsed by poppler and the pdf reader per byte of input
+
+struct memory_t* memory_new(size_t limit) {
+	struct memory_t *memory = malloc(sizeof(struct memory_t));
+	memory->limit = limit;
+	memory->used = 0;
+	memory->peak = 0;
+	memory->dropped_recordings = 0;
+	memory->limited_threads = 0;
+	pthread_mutex_init(&memory->lock, NULL);
+	return memory;
+}
+
+void memory_free(struct memory_t *memory) {
+	pthread_mutex_destroy(&memory->lock);
+	free(memory);
+}
+
+void memory_add(struct memory_t *memory, size_t size) {
+	pthread_mutex_lock(&memory->lock);
+	memory->used += size;
+	if (memory->used > memory->peak) {
+		memory->peak = memory->used;
+	}
+	pthread_mutex_unlock(&memory->lock);
+}
+
+void memory_release(struct memory_t *memory, size_t size) {
+	pthread_mutex_lock(&memory->lock);
+	memory->used = size < memory->used ? memory->used - size : 0;
+	pthread_mutex_unlock(&memory->lock);
+}
+
+// what is left of the budget, SIZE_MAX without a limit
+size_t memory_available(struct memory_t *memory) {
+	if (memory->limit == 0) {
+		return SIZE_MAX;
+	}
+	pthread_mutex_lock(&memory->lock);
+	size_t available = memory->used < memory->limit ? memory->limit - memory->used : 0;
+	pthread_mutex_unlock(&memory->lock);
+	return available;
+}
+
+// how many of wanted threads, each using per_thread, fit in the budget
+// at least one, the main thread draws anyway
+int memory_threads(struct memory_t *memory, size_t per_thread, int wanted) {
+	size_t available = memory_available(memory);
+	int threads = wanted;
+	if (per_thread > 0 && available / per_thread < (size_t) wanted) {
+		threads = available / per_thread;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads < wanted) {
+		memory->limited_threads = threads;
+	}
+	return threads;
+}
+
+// estimated bytes of a recording of page num
+size_t page_memory(struct pdf_file_t *pdf, int num) {
+	double content, pixels;
+	page_size(pdf, num, &content, &pixels);
+	// images are kept decoded, four bytes per pixel
+	return RECORDING_OVERHEAD + content * RECORDING_CONTENT_FACTOR + pixels * 4;
+}
+
+// estimated bytes of the document, page pool and pdf reader a thread opens
+size_t document_memory(struct pages_t *pages) {
+	size_t input = pages->pdf != NULL ? pages->pdf->size : 0;
+	return DOCUMENT_OVERHEAD + input * DOCUMENT_INPUT_FACTOR;
+}
+
+void print_memory_stats(struct memory_t *memory) {
+	if (memory->limit == 0) {
+		return;
+	}
+	message("Memory: %zu MB of %zu MB at the peak, %ld MB resident\n", memory->peak >> 20, memory->limit >> 20,
+		progress_peak_rss_kb() >> 10);
+	if (memory->dropped_recordings > 0) {
+		message("  %d recordings dropped, their pages were drawn again\n", memory->dropped_recordings);
+	}
+	if (memory->limited_threads > 0) {
+		message("  drew on %d threads\n", memory->limited_threads);
+	}
+}
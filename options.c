@@ -8,13 +8,29 @@ void usage(char *executable_name) {
 	printf("\t--paper {a4,letter}\tSize of paper to be printed on. Default is a4\n");
 	printf("\t--type {chapbook,perfect}\n\t\t\t\tType of imposition to make. Default is chapbook\n");
 	printf("\t--trim {even-odd,document,per-page}\n\t\t\t\tControls how whitespace is trimmed off.\n\t\t\t\tDefault is even-odd.\n");
+	printf("\t--fast-trim\t\tfind the whitespace of text only pages without drawing them\n");
+	printf("\t--trim-sample N\t\tdraw only N pages per crop box and check the rest\n\t\t\t\tfrom their text layout (even-odd and document trim)\n");
+	printf("\t--pipeline\t\tlay out the book while the pages are trimmed (per-page trim)\n");
+	printf("\t--engine {render,xobject}\n\t\t\t\tHow pages are drawn on the output. Default is render.\n");
+	printf("\t--threads N\t\tdraw pages on N threads, placing them as form XObjects\n\t\t\t\tlike --engine xobject. Default is 1\n");
+	printf("\t--max-memory MB\t\tkeep fewer drawings and threads to stay within MB megabytes\n");
+	printf("\t--write-buffers N\twrite the output on a thread through N buffers of 1 MB,\n\t\t\t\t0 writes while laying out. Default is 4\n");
+	printf("\t--sync {none,end,chunks}\n\t\t\t\tWhen the output file is synced to disk. Default is none.\n");
+	printf("\t--dedup\t\t\tstore identical images and fonts only once in the output\n");
+	printf("\t--split N\t\twrite the book as files of N sheets each and a manifest\n\t\t\t\tlisting them in print order\n");
 	printf("\t--nopagenumbers\t\tsuppress additional page numbers\n");
+	printf("\t--color {keep,gray,bitonal}\n\t\t\t\tColors of scanned pages. Default is keep.\n");
+	printf("\t--passthrough\t\tpass the JPEG and JPEG 2000 images of scanned\n\t\t\t\tpages through undecoded\n");
 	printf("\t--print\t\t\tsend result to default printer instead of saving to file\n");
 	printf("\t--printer PRINTER\tprint result to specific printer\n\t\t\t\t(implies --print)\n");
 	printf("\t--cover, -c\t\tAdd a cover to the PDF\n\t\t\t\tUses the first page of the PDF if --title is not specified\n");
 	printf("\t--title\t\t\tThe title for the generated cover page (implies --cover)\n");
 	printf("\t--date\t\t\tThe date for the generated cover page\n");
 	printf("\t--author\t\tThe author for the generated cover page\n");
+	printf("\t--watch\t\t\tmake the book again whenever the input is rewritten\n");
+	printf("\t--deterministic\t\twrite the same bytes for the same input and options\n");
+	printf("\t--verify\t\tcompare the book with one made without the fast paths\n");
+	printf("\t--progress FD\t\twrite progress as newline-delimited JSON to file descriptor FD\n");
 	printf("\t--version\t\tprints the version string and exits\n");
 	exit(1);
 }
@@ -44,16 +60,79 @@ char *create_output_filename(char *input_filename) {
 	return output_filename;
 }
 
-struct options_t parse_options(int argc, char** argv) {
+enum option_t {
+	paper_option,
+	type_option,
+	trim_option,
+	fast_trim_option,
+	trim_sample_option,
+	engine_option,
+	threads_option,
+	max_memory_option,
+	dedup_option,
+	split_option,
+	no_page_numbers_option,
+	passthrough_option,
+	print_option,
+	printer_option,
+	version_option,
+	title_option,
+	date_option,
+	author_option,
+	progress_option,
+	watch_option,
+	write_buffers_option,
+	sync_option,
+	deterministic_option,
+	verify_option,
+	pipeline_option,
+	color_option
+};
+
+static const struct option longopts[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"paper", required_argument, NULL, paper_option},
+	{"type", required_argument, NULL, type_option},
+	{"trim", required_argument, NULL, trim_option},
+	{"fast-trim", no_argument, NULL, fast_trim_option},
+	{"trim-sample", required_argument, NULL, trim_sample_option},
+	{"engine", required_argument, NULL, engine_option},
+	{"threads", required_argument, NULL, threads_option},
+	{"max-memory", required_argument, NULL, max_memory_option},
+	{"dedup", no_argument, NULL, dedup_option},
+	{"split", required_argument, NULL, split_option},
+	{"nopagenumbers", no_argument, NULL, no_page_numbers_option},
+	{"passthrough", no_argument, NULL, passthrough_option},
+	{"print", no_argument, NULL, print_option},
+	{"printer", required_argument, NULL, printer_option},
+	{"version", no_argument, NULL, version_option},
+	{"cover", no_argument, NULL, 'c'},
+	{"title", required_argument, NULL, title_option},
+	{"date", required_argument, NULL, date_option},
+	{"author", required_argument, NULL, author_option},
+	{"progress", required_argument, NULL, progress_option},
+	{"watch", no_argument, NULL, watch_option},
+	{"write-buffers", required_argument, NULL, write_buffers_option},
+	{"sync", required_argument, NULL, sync_option},
+	{"deterministic", no_argument, NULL, deterministic_option},
+	{"verify", no_argument, NULL, verify_option},
+	{"pipeline", no_argument, NULL, pipeline_option},
+	{"color", required_argument, NULL, color_option},
+	{NULL, 0, NULL, 0}
+};
+
+struct options_t default_options(char *executable_name) {
 	struct options_t options;
 
-	// set defaults
-	options.executable_name = argv[0];
+	options.executable_name = executable_name;
 	options.input_filename = NULL;
+	options.input_data = NULL;
+	options.input_length = 0;
 	options.output_filename = NULL;
 	options.paper = a4;
 	options.type = chapbook;
 	options.trim = even_odd;
+	options.engine = render;
 	options.print_page_numbers = TRUE;
 	options.print = FALSE;
 	options.printer = NULL;
@@ -61,107 +140,252 @@ struct options_t parse_options(int argc, char** argv) {
 	options.title = NULL;
 	options.date = NULL;
 	options.author = NULL;
+	options.progress_fd = -1;
+	options.dedup = FALSE;
+	options.fast_trim = FALSE;
+	options.trim_sample = 0;
+	options.passthrough = FALSE;
+	options.split = 0;
+	options.threads = 1;
+	options.max_memory = 0;
+	options.watch = FALSE;
+	options.write_buffers = 4;
+	options.sync = sync_none;
+	options.deterministic = FALSE;
+	options.verify = FALSE;
+	options.pipeline = FALSE;
+	options.color = color_keep;
 
-	enum {
-		paper_option,
-		type_option,
-		trim_option,
-		no_page_numbers_option,
-		print_option,
-		printer_option,
-		version_option,
-		title_option,
-		date_option,
-		author_option
-	};
-	const char *optstring = "hc";
-	const struct option longopts[] = {
-		{"help", no_argument, NULL, 'h'},
-		{"paper", required_argument, NULL, paper_option},
-		{"type", required_argument, NULL, type_option},
-		{"trim", required_argument, NULL, trim_option},
-		{"nopagenumbers", no_argument, NULL, no_page_numbers_option},
-		{"print", no_argument, NULL, print_option},
-		{"printer", required_argument, NULL, printer_option},
-		{"version", no_argument, NULL, version_option},
-		{"cover", no_argument, NULL, 'c'},
-		{"title", required_argument, NULL, title_option},
-		{"date", required_argument, NULL, date_option},
-		{"author", required_argument, NULL, author_option}
-	};
+	return options;
+}
+
+// finds the option called name on the command line (without the --)
+// returns -1 if there is none
+int find_option(const char *name, int *has_value) {
+	int i;
+	for (i = 0; longopts[i].name != NULL; i++) {
+		if (strcmp(longopts[i].name, name) == 0) {
+			*has_value = longopts[i].has_arg == required_argument;
+			return longopts[i].val;
+		}
+	}
+	return -1;
+}
 
+// sets option to value, which is NULL for options without one
+// string values are used as they are and must outlive the options
+// returns NULL, or the error message which the caller frees
+char* set_option(struct options_t *options, int option, char *value) {
+	char *error = NULL;
+	char *end;
+
+	switch (option) {
+	case paper_option:
+		if (strcasecmp(value, "a4") == 0) {
+			options->paper = a4;
+		} else if (strcasecmp(value, "letter") == 0) {
+			options->paper = letter;
+		} else {
+			asprintf(&error, "Unknown paper size: %s", value);
+		}
+		break;
+	case type_option:
+		if (strcasecmp(value, "chapbook") == 0) {
+			options->type = chapbook;
+		} else if (strcasecmp(value, "perfect") == 0) {
+			options->type = perfect;
+		} else {
+			asprintf(&error, "Unknown binding type: %s", value);
+		}
+		break;
+	case trim_option:
+		if (strcasecmp(value, "even-odd") == 0) {
+			options->trim = even_odd;
+		} else if (strcasecmp(value, "document") == 0) {
+			options->trim = document;
+		} else if (strcasecmp(value, "per-page") == 0) {
+			options->trim = per_page;
+		} else {
+			asprintf(&error, "Unknown trim type: %s", value);
+		}
+		break;
+	case fast_trim_option:
+		options->fast_trim = TRUE;
+		break;
+	case trim_sample_option:
+		options->trim_sample = strtol(value, &end, 10);
+		if (*end != 0 || options->trim_sample < 1) {
+			asprintf(&error, "Not a number of pages: %s", value);
+		}
+		break;
+	case engine_option:
+		if (strcasecmp(value, "render") == 0) {
+			options->engine = render;
+		} else if (strcasecmp(value, "xobject") == 0) {
+			options->engine = xobject;
+		} else {
+			asprintf(&error, "Unknown engine: %s", value);
+		}
+		break;
+	case threads_option:
+		options->threads = strtol(value, &end, 10);
+		if (*end != 0 || options->threads < 1) {
+			asprintf(&error, "Not a number of threads: %s", value);
+		}
+		break;
+	case max_memory_option: {
+		long megabytes = strtol(value, &end, 10);
+		if (*end != 0 || megabytes < 1) {
+			asprintf(&error, "Not a number of megabytes: %s", value);
+		}
+		options->max_memory = (size_t) megabytes << 20;
+		break;
+	}
+	case dedup_option:
+		options->dedup = TRUE;
+		break;
+	case split_option:
+		options->split = strtol(value, &end, 10);
+		if (*end != 0 || options->split < 1) {
+			asprintf(&error, "Not a number of sheets: %s", value);
+		}
+		break;
+	case no_page_numbers_option:
+		options->print_page_numbers = FALSE;
+		break;
+	case passthrough_option:
+		options->passthrough = TRUE;
+		break;
+	case printer_option:
+		options->printer = value;
+		// NO BREAK; --printer implies --print
+	case print_option:
+		options->print = TRUE;
+		break;
+	case 'c':
+		options->add_cover = TRUE;
+		break;
+	case title_option:
+		options->add_cover = TRUE;
+		options->title = value;
+		break;
+	case date_option:
+		options->date = value;
+		break;
+	case author_option:
+		options->author = value;
+		break;
+	case progress_option:
+		options->progress_fd = strtol(value, &end, 10);
+		if (*end != 0 || options->progress_fd < 0 || fcntl(options->progress_fd, F_GETFD) == -1) {
+			asprintf(&error, "Not an open file descriptor: %s", value);
+		}
+		break;
+	case watch_option:
+		options->watch = TRUE;
+		break;
+	case write_buffers_option:
+		options->write_buffers = strtol(value, &end, 10);
+		// one buffer is filled while the others are written
+		if (*end != 0 || options->write_buffers < 0 || options->write_buffers == 1) {
+			asprintf(&error, "Not 0 or at least 2 buffers: %s", value);
+		}
+		break;
+	case deterministic_option:
+		options->deterministic = TRUE;
+		break;
+	case verify_option:
+		options->verify = TRUE;
+		break;
+	case pipeline_option:
+		options->pipeline = TRUE;
+		break;
+	case color_option:
+		if (strcmp(value, "keep") == 0) {
+			options->color = color_keep;
+		} else if (strcmp(value, "gray") == 0) {
+			options->color = color_gray;
+		} else if (strcmp(value, "bitonal") == 0) {
+			options->color = color_bitonal;
+		} else {
+			asprintf(&error, "Unknown color: %s", value);
+		}
+		break;
+	case sync_option:
+		if (strcmp(value, "none") == 0) {
+			options->sync = sync_none;
+		} else if (strcmp(value, "end") == 0) {
+			options->sync = sync_end;
+		} else if (strcmp(value, "chunks") == 0) {
+			options->sync = sync_chunks;
+		} else {
+			asprintf(&error, "Unknown sync: %s", value);
+		}
+		break;
+	default:
+		asprintf(&error, "Unknown option");
+	}
+
+	return error;
+}
+
+// checks the options that depend on each other
+// returns NULL, or the error message which the caller frees
+char* check_options(struct options_t *options) {
+	char *error = NULL;
+	if (options->trim_sample > 0 && options->trim == per_page) {
+		asprintf(&error, "--trim-sample needs even-odd or document trim");
+	} else if (options->split > 0 && options->print) {
+		asprintf(&error, "--split writes files and can not be printed");
+	} else if (options->watch && options->print) {
+		asprintf(&error, "--watch would print the book every time the input changes");
+	} else if (options->pipeline && options->trim != per_page) {
+		asprintf(&error, "--pipeline needs per-page trim");
+	} else if (options->pipeline && options->split > 0) {
+		asprintf(&error, "--pipeline lays out the sheets in order and can not be split");
+	} else if (options->verify && (options->print || options->split > 0)) {
+		asprintf(&error, "--verify reads the book back from a single output file");
+	}
+	return error;
+}
+
+struct options_t parse_options(int argc, char** argv) {
+	struct options_t options = default_options(argv[0]);
+
+	const char *optstring = "hc";
 	int opt;
 	while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
+		char *error = NULL;
 		switch (opt) {
-		case paper_option:
-			if (strcasecmp(optarg, "a4") == 0) {
-				options.paper = a4;
-			} else if (strcasecmp(optarg, "letter") == 0) {
-				options.paper = letter;
-			} else {
-				printf("ERROR: Unknown paper size: %s\n\n", optarg);
-				usage(options.executable_name);
-			}
-			break;
-		case type_option:
-			if (strcasecmp(optarg, "chapbook") == 0) {
-				options.type = chapbook;
-			} else if (strcasecmp(optarg, "perfect") == 0) {
-				options.type = perfect;
-			} else {
-				printf("ERROR: Unknown binding type: %s\n\n", optarg);
-				usage(options.executable_name);
-			}
-			break;
-		case trim_option:
-			if (strcasecmp(optarg, "even-odd") == 0) {
-				options.trim = even_odd;
-			} else if (strcasecmp(optarg, "document") == 0) {
-				options.trim = document;
-			} else if (strcasecmp(optarg, "per-page") == 0) {
-				options.trim = per_page;
-			} else {
-				printf("ERROR: Unknown trim type: %s\n\n", optarg);
-				usage(options.executable_name);
-			}
-			break;
-		case no_page_numbers_option:
-			options.print_page_numbers = FALSE;
-			break;
-		case printer_option:
-			options.printer = optarg;
-			// NO BREAK; --printer implies --print
-		case print_option:
-			options.print = TRUE;
-			break;
 		case version_option:
 			printf("%s\n", VERSION);
 			exit(0);
-		case 'c':
-			options.add_cover = TRUE;
-			break;
-		case title_option:
-			options.add_cover = TRUE;
-			options.title = optarg;
-			break;
-		case date_option:
-			options.date = optarg;
-			break;
-		case author_option:
-			options.author = optarg;
-			break;
 		case 'h': // same as default
+		case '?':
+			usage(options.executable_name);
 		default:
+			error = set_option(&options, opt, optarg);
+		}
+		if (error != NULL) {
+			printf("ERROR: %s\n\n", error);
+			free(error);
 			usage(options.executable_name);
 		}
 	}
 
+	char *error = check_options(&options);
+	if (error != NULL) {
+		printf("ERROR: %s\n\n", error);
+		free(error);
+		usage(options.executable_name);
+	}
+
 	argc -= optind;
 	argv += optind;
 
 	switch (argc) {
 	case 2:
-		options.output_filename = argv[1];
+		options.output_filename = strdup(argv[1]);
 	case 1:
 		options.input_filename = argv[0];
 		break;
@@ -224,12 +448,89 @@ void print_options(struct options_t options) {
 	default:
 		printf("ERROR\n");
 	}
+	printf("FAST TRIM: ");
+	if (options.fast_trim) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
+	printf("TRIM SAMPLE: ");
+	if (options.trim_sample > 0) {
+		printf("%d pages\n", options.trim_sample);
+	} else {
+		printf("no\n");
+	}
+	printf("ENGINE: ");
+	switch (options.engine) {
+	case render:
+		printf("render\n");
+		break;
+	case xobject:
+		printf("xobject\n");
+		break;
+	default:
+		printf("ERROR\n");
+	}
+	printf("THREADS: %d\n", options.threads);
+	printf("MAX MEMORY: ");
+	if (options.max_memory > 0) {
+		printf("%zu MB\n", options.max_memory >> 20);
+	} else {
+		printf("no limit\n");
+	}
+	printf("WRITE BUFFERS: %d\n", options.write_buffers);
+	printf("SYNC: ");
+	switch (options.sync) {
+	case sync_none:
+		printf("none\n");
+		break;
+	case sync_end:
+		printf("end\n");
+		break;
+	case sync_chunks:
+		printf("chunks\n");
+		break;
+	default:
+		printf("ERROR\n");
+	}
+	printf("DEDUP: ");
+	if (options.dedup) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
+	printf("SPLIT: ");
+	if (options.split > 0) {
+		printf("%d sheets\n", options.split);
+	} else {
+		printf("no\n");
+	}
 	printf("PAGE NUMBERS: ");
 	if (options.print_page_numbers) {
 		printf("yes\n");
 	} else {
 		printf("no\n");
 	}
+	printf("COLOR: ");
+	switch (options.color) {
+	case color_keep:
+		printf("keep\n");
+		break;
+	case color_gray:
+		printf("gray\n");
+		break;
+	case color_bitonal:
+		printf("bitonal\n");
+		break;
+	default:
+		printf("ERROR\n");
+	}
+	printf("PASSTHROUGH: ");
+	if (options.passthrough && !options.print) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
 	printf("PRINT: ");
 	if (options.print) {
 		printf("yes\n");
@@ -246,4 +547,34 @@ void print_options(struct options_t options) {
 	printf("TITLE: %s\n", options.title);
 	printf("DATE: %s\n", options.date);
 	printf("AUTHOR: %s\n", options.author);
+	printf("PROGRESS: ");
+	if (options.progress_fd >= 0) {
+		printf("fd %d\n", options.progress_fd);
+	} else {
+		printf("no\n");
+	}
+	printf("PIPELINE: ");
+	if (options.pipeline) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
+	printf("DETERMINISTIC: ");
+	if (options.deterministic) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
+	printf("VERIFY: ");
+	if (options.verify) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
+	printf("WATCH: ");
+	if (options.watch) {
+		printf("yes\n");
+	} else {
+		printf("no\n");
+	}
 }
@@ -12,7 +12,143 @@ struct pages_t* all_pages(PopplerDocument *document, struct options_t options) {
 		struct page_t *page = &pages->pages[page_num];
 
 		page->num = page_num;
+		page->crop_box = -1;
+		page->has_ink_extents = FALSE;
+	}
+
+	pages->pool = page_pool_new(document, PAGE_POOL_CAPACITY);
+	// split books are laid out by threads with page pools of their own
+	// without a budget, keeping every recording until layout is unbounded
+	pages->pool->keep_recordings = options.engine == xobject && options.split == 0 && options.max_memory > 0;
+	pages->workers = NULL;
+	pages->pipeline = NULL;
+
+	pages->crop_boxes = NULL;
+	pages->ncrop_boxes = 0;
+	pages->allocated_crop_boxes = 0;
+
+	pages->pdf = NULL;
+	// the postscript surface can not pass jpeg 2000 images through
+	pages->passthrough = options.passthrough && !options.print;
+	// threads and the memory budget estimate the cost of drawing pages from
+	// their objects, watching hashes them
+	if (options.fast_trim || options.trim_sample > 0 || pages->passthrough || options.threads > 1 || options.max_memory > 0
+		|| options.watch || options.color != color_keep) {
+		pages->pdf = open_input_objects(options);
+	}
+	pages->fast_trim = options.fast_trim;
+	pages->trimmed_pages = 0;
+	pages->fast_trimmed_pages = 0;
+	pages->trim_sample = options.trim_sample;
+	pages->sampled_pages = 0;
+	pages->escalated_pages = 0;
+	pages->passthrough_pages = 0;
+	pages->color = options.color;
+	pages->converted_pages = 0;
+
+	progress_init(&pages->progress, options.progress_fd);
+
+	pages->memory = memory_new(options.max_memory);
+	pages->recording_sizes = NULL;
+	pages->largest_recording = 0;
+	if (options.max_memory > 0) {
+		pages->recording_sizes = malloc(sizeof(size_t)*pages->pool->npages);
+		int num;
+		for (num = 0; num < pages->pool->npages; num++) {
+			pages->recording_sizes[num] = page_memory(pages->pdf, num);
+			if (pages->recording_sizes[num] > pages->largest_recording) {
+				pages->largest_recording = pages->recording_sizes[num];
+			}
+		}
+		pages->pool->memory = pages->memory;
+		pages->pool->recording_sizes = pages->recording_sizes;
+	}
+
+	if (options.threads > 1) {
+		start_workers(pages, options);
 	}
 
 	return pages;
-}
\ No newline at end of file
+}
+
+// makes copy a view of pages for another thread, with a page pool and pdf
+// reader of its own for document, sharing the pages and crop boxes
+void worker_pages(struct pages_t *copy, struct pages_t *pages, PopplerDocument *document) {
+	*copy = *pages;
+	copy->pool = page_pool_new(document, PAGE_POOL_CAPACITY);
+	copy->pool->memory = pages->pool->memory;
+	copy->pool->recording_sizes = pages->pool->recording_sizes;
+	if (pages->pdf != NULL) {
+		copy->pdf = pdf_file_open_data(pages->pdf->data, pages->pdf->size);
+	}
+	copy->workers = NULL;
+	copy->pipeline = NULL;
+	copy->trimmed_pages = 0;
+	copy->fast_trimmed_pages = 0;
+	copy->passthrough_pages = 0;
+	copy->converted_pages = 0;
+	progress_init(&copy->progress, -1);
+	memory_add(pages->memory, document_memory(pages));
+}
+
+// adds the counts of a copy made by worker_pages to pages and frees it
+// callers on other threads hold a lock
+void worker_pages_finish(struct pages_t *copy, struct pages_t *pages) {
+	struct page_pool_t *pool = pages->pool;
+	pool->loads += copy->pool->loads;
+	pool->hits += copy->pool->hits;
+	pool->evictions += copy->pool->evictions;
+	pool->recordings += copy->pool->recordings;
+	pool->recording_hits += copy->pool->recording_hits;
+	pages->trimmed_pages += copy->trimmed_pages;
+	pages->fast_trimmed_pages += copy->fast_trimmed_pages;
+	pages->passthrough_pages += copy->passthrough_pages;
+	pages->converted_pages += copy->converted_pages;
+
+	page_pool_free(copy->pool);
+	if (copy->pdf != NULL) {
+		pdf_file_free(copy->pdf);
+	}
+	memory_release(pages->memory, document_memory(pages));
+}
+
+// adds an empty crop box and returns its index
+// pointers to crop boxes are invalidated by adding another one
+int new_crop_box(struct pages_t *pages) {
+	if (pages->ncrop_boxes == pages->allocated_crop_boxes) {
+		pages->allocated_crop_boxes = pages->allocated_crop_boxes ? pages->allocated_crop_boxes * 2 : 2;
+		pages->crop_boxes = realloc(pages->crop_boxes, sizeof(cairo_rectangle_t)*pages->allocated_crop_boxes);
+	}
+
+	int index = pages->ncrop_boxes++;
+	cairo_rectangle_t *crop_box = &pages->crop_boxes[index];
+	crop_box->x = 0;
+	crop_box->y = 0;
+	crop_box->width = 0;
+	crop_box->height = 0;
+	return index;
+}
+
+cairo_rectangle_t* page_crop_box(struct pages_t *pages, struct page_t *page) {
+	if (page->crop_box < 0 || page->crop_box >= pages->ncrop_boxes) {
+		fail("%s:%d: page %d has no crop box", __FILE__, __LINE__, page->num);
+	}
+	return &pages->crop_boxes[page->crop_box];
+}
+
+void pages_free(struct pages_t *pages) {
+	// a failed layout leaves the pipeline running, its error is not raised again
+	if (pages->pipeline != NULL) {
+		free(stop_pipeline(pages));
+	}
+	stop_workers(pages);
+	page_pool_free(pages->pool);
+	memory_free(pages->memory);
+	free(pages->recording_sizes);
+	if (pages->pdf != NULL) {
+		pdf_file_free(pages->pdf);
+	}
+	free(pages->crop_boxes);
+	free(pages->pages);
+	free(pages);
+}
@@ -0,0 +1,402 @@
+#include "all.h"
+
+// method: scanned pages only draw images, placed by a content stream of q, cm,
+// Do and Q. When every image is stored as a JPEG (DCTDecode) or JPEG 2000 file
+// (JPXDecode) the page is drawn here instead of by poppler. Each image becomes
+// a one pixel surface carrying the original compressed bytes as mime data,
+// which the pdf surface writes out at the size given in the compressed data
+// instead of the pixel, so the images are never decoded or encoded again.
+
+#define PASSTHROUGH_MAX_DEPTH 32
+
+// reads the size and number of components from the start of frame of a jpeg
+int jpeg_info(const unsigned char *data, size_t length, int *width, int *height, int *components) {
+	if (length < 4 || data[0] != 0xff || data[1] != 0xd8) {
+		return FALSE;
+	}
+
+	size_t pos = 2;
+	while (pos + 4 <= length) {
+		if (data[pos] != 0xff) {
+			return FALSE;
+		}
+		unsigned char marker = data[pos + 1];
+		if (marker == 0xff) {
+			// fill byte
+			pos++;
+			continue;
+		}
+		if (marker == 0xd9 || marker == 0xda) {
+			// end of image or start of scan before any frame
+			return FALSE;
+		}
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			if (pos + 10 > length) {
+				return FALSE;
+			}
+			*height = data[pos + 5] << 8 | data[pos + 6];
+			*width = data[pos + 7] << 8 | data[pos + 8];
+			*components = data[pos + 9];
+			return TRUE;
+		}
+		pos += 2 + (data[pos + 2] << 8 | data[pos + 3]);
+	}
+	return FALSE;
+}
+
+uint32_t read_uint32(const unsigned char *data) {
+	return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+// reads the size from the image header of a jp2 file
+// raw jpeg 2000 codestreams are not jp2 files and can not be passed through
+int jp2_info(const unsigned char *data, size_t length, int *width, int *height) {
+	static const unsigned char signature[] = {0, 0, 0, 12, 'j', 'P', ' ', ' ', '\r', '\n', 0x87, '\n'};
+	if (length < sizeof(signature) || memcmp(data, signature, sizeof(signature)) != 0) {
+		return FALSE;
+	}
+
+	size_t pos = sizeof(signature);
+	size_t end = length;
+	while (pos + 8 <= end) {
+		size_t box_length = read_uint32(data + pos);
+		if (box_length < 8 || box_length > end - pos) {
+			return FALSE;
+		}
+		if (memcmp(data + pos + 4, "jp2h", 4) == 0) {
+			// the header box is a superbox, continue inside it
+			end = pos + box_length;
+			pos += 8;
+			continue;
+		}
+		if (memcmp(data + pos + 4, "ihdr", 4) == 0) {
+			if (box_length < 16) {
+				return FALSE;
+			}
+			*height = read_uint32(data + pos + 8);
+			*width = read_uint32(data + pos + 12);
+			return TRUE;
+		}
+		pos += box_length;
+	}
+	return FALSE;
+}
+
+// returns the mime type the image can be passed through as, NULL if it can not
+const char* passthrough_mime_type(struct pdf_file_t *pdf, struct pdf_value_t *image) {
+	if (image == NULL || image->type != pdf_stream || !pdf_is_name(pdf_dict_get(image, "Subtype"), "Image")) {
+		return NULL;
+	}
+
+	// anything changing how the samples are drawn needs poppler
+	const char *unsupported[] = {"SMask", "Mask", "Decode", "DecodeParms", "SMaskInData", NULL};
+	int i;
+	for (i = 0; unsupported[i] != NULL; i++) {
+		if (pdf_dict_get(image, unsupported[i]) != NULL) {
+			return NULL;
+		}
+	}
+	struct pdf_value_t *image_mask = pdf_dict_resolve(pdf, image, "ImageMask");
+	if (image_mask != NULL && image_mask->type == pdf_bool && image_mask->number != 0) {
+		return NULL;
+	}
+
+	struct pdf_value_t *filter = pdf_dict_resolve(pdf, image, "Filter");
+	if (filter != NULL && filter->type == pdf_array && filter->length == 1) {
+		filter = pdf_resolve(pdf, filter->items[0]);
+	}
+
+	// the colors come from the image data, so the color space must agree with it
+	struct pdf_value_t *color_space = pdf_dict_resolve(pdf, image, "ColorSpace");
+	int gray = pdf_is_name(color_space, "DeviceGray");
+	int rgb = pdf_is_name(color_space, "DeviceRGB");
+
+	long width = pdf_integer(pdf, pdf_dict_get(image, "Width"), 0);
+	long height = pdf_integer(pdf, pdf_dict_get(image, "Height"), 0);
+	int data_width, data_height, components;
+
+	if (pdf_is_name(filter, "DCTDecode")) {
+		if (pdf_integer(pdf, pdf_dict_get(image, "BitsPerComponent"), 0) != 8 ||
+			!jpeg_info(image->stream, image->stream_length, &data_width, &data_height, &components) ||
+			!((gray && components == 1) || (rgb && components == 3))) {
+			return NULL;
+		}
+		if (data_width != width || data_height != height) {
+			return NULL;
+		}
+		return CAIRO_MIME_TYPE_JPEG;
+	}
+
+	if (pdf_is_name(filter, "JPXDecode")) {
+		if ((color_space != NULL && !gray && !rgb) ||
+			!jp2_info(image->stream, image->stream_length, &data_width, &data_height)) {
+			return NULL;
+		}
+		if (data_width != width || data_height != height) {
+			return NULL;
+		}
+		return CAIRO_MIME_TYPE_JP2;
+	}
+
+	return NULL;
+}
+
+// finds the images drawn by a content stream that only draws images
+// returns the number of images, or -1 if the content draws anything else or,
+// unless any_image, an image can not be passed through
+int passthrough_images(struct pdf_file_t *pdf, struct pdf_value_t *page, unsigned char *content, size_t length,
+	cairo_matrix_t *base, int any_image, struct passthrough_image_t **images) {
+	static const char *ignored_operators[] = {"BMC", "BDC", "EMC", "MP", "DP", "w", "J", "j", "M", "d", "ri", "i", NULL};
+
+	struct pdf_value_t *resources = pdf_page_attribute(pdf, page, "Resources");
+	struct pdf_value_t *xobjects = pdf_dict_resolve(pdf, resources, "XObject");
+
+	cairo_matrix_t stack[PASSTHROUGH_MAX_DEPTH];
+	int depth = 0;
+	stack[0] = *base;
+
+	int nimages = 0;
+	int allocated = 0;
+	*images = NULL;
+
+	double operands[6];
+	int noperands = 0;
+
+	struct pdf_lexer_t lexer = {content, 0, length};
+	struct pdf_token_t token;
+	struct pdf_token_t previous = {token_eof, content, 0};
+	while (pdf_next_token(&lexer, &token)) {
+		if (token.type == token_number) {
+			if (noperands < 6) {
+				operands[noperands] = pdf_token_number(&token);
+			}
+			noperands++;
+			previous = token;
+			continue;
+		}
+		if (token.type != token_keyword) {
+			// names and dictionaries are only operands of Do and marked content
+			noperands = 7;
+			previous = token;
+			continue;
+		}
+
+		int ignored = FALSE;
+		int i;
+		for (i = 0; ignored_operators[i] != NULL; i++) {
+			ignored = ignored || pdf_token_is(&token, ignored_operators[i]);
+		}
+
+		if (ignored) {
+			// marked content and path state do not draw anything
+		} else if (pdf_token_is(&token, "q")) {
+			if (depth + 1 == PASSTHROUGH_MAX_DEPTH) {
+				goto NOT_IMAGES;
+			}
+			stack[depth + 1] = stack[depth];
+			depth++;
+		} else if (pdf_token_is(&token, "Q")) {
+			if (depth > 0) {
+				depth--;
+			}
+		} else if (pdf_token_is(&token, "cm")) {
+			if (noperands != 6) {
+				goto NOT_IMAGES;
+			}
+			cairo_matrix_t matrix;
+			cairo_matrix_init(&matrix, operands[0], operands[1], operands[2], operands[3], operands[4], operands[5]);
+			cairo_matrix_multiply(&stack[depth], &matrix, &stack[depth]);
+		} else if (pdf_token_is(&token, "Do")) {
+			if (previous.type != token_name) {
+				goto NOT_IMAGES;
+			}
+			char *name = pdf_decode_name(&previous);
+			struct pdf_value_t *reference = xobjects != NULL ? pdf_dict_get(xobjects, name) : NULL;
+			free(name);
+			if (reference == NULL || reference->type != pdf_ref) {
+				goto NOT_IMAGES;
+			}
+
+			struct pdf_value_t *image = pdf_resolve(pdf, reference);
+			const char *mime_type = passthrough_mime_type(pdf, image);
+			if (mime_type == NULL && !(any_image && image != NULL && image->type == pdf_stream
+				&& pdf_is_name(pdf_dict_get(image, "Subtype"), "Image"))) {
+				goto NOT_IMAGES;
+			}
+
+			if (nimages == allocated) {
+				allocated = allocated == 0 ? 4 : allocated * 2;
+				*images = realloc(*images, sizeof(struct passthrough_image_t) * allocated);
+			}
+			struct passthrough_image_t *found = &(*images)[nimages++];
+			found->matrix = stack[depth];
+			found->image = image;
+			found->num = reference->num;
+			found->width = (int) pdf_integer(pdf, pdf_dict_get(image, "Width"), 0);
+			found->height = (int) pdf_integer(pdf, pdf_dict_get(image, "Height"), 0);
+			found->mime_type = mime_type;
+		} else {
+			goto NOT_IMAGES;
+		}
+
+		noperands = 0;
+		previous = token;
+	}
+	return nimages;
+
+NOT_IMAGES:
+	free(*images);
+	*images = NULL;
+	return -1;
+}
+
+void draw_passthrough_image(cairo_t *cr, struct passthrough_image_t *found) {
+	// the pdf surface only draws the mime data, which fills the surface
+	// whatever its size, so the surface has a single pixel
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
+	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
+
+	// the pdf surface writes the images out after the input is closed
+	unsigned char *data = malloc(found->image->stream_length);
+	memcpy(data, found->image->stream, found->image->stream_length);
+	cairo_surface_set_mime_data(surface, found->mime_type, data, found->image->stream_length, free, data);
+
+	// images drawn more than once are written once
+	char *unique_id;
+	asprintf(&unique_id, "bookmaker-image-%d", found->num);
+	cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_UNIQUE_ID,
+		(unsigned char *) unique_id, strlen(unique_id), free, unique_id);
+
+	// images fill the unit square with their first row at the top
+	cairo_save(cr);
+	cairo_transform(cr, &found->matrix);
+	cairo_translate(cr, 0, 1);
+	cairo_scale(cr, 1, -1);
+	cairo_set_source_surface(cr, surface, 0, 0);
+	cairo_paint(cr);
+	cairo_restore(cr);
+
+	cairo_surface_destroy(surface);
+}
+
+// the box poppler draws the page in, the crop box limited to the media box
+void passthrough_page_box(struct pdf_file_t *pdf, struct pdf_value_t *page, double box[4]) {
+	double media[4] = {0, 0, 612, 792};
+	double crop[4];
+	struct pdf_value_t *boxes[2] = {
+		pdf_resolve(pdf, pdf_page_attribute(pdf, page, "MediaBox")),
+		pdf_resolve(pdf, pdf_page_attribute(pdf, page, "CropBox"))
+	};
+	double *values[2] = {media, crop};
+
+	int b;
+	for (b = 0; b < 2; b++) {
+		if (boxes[b] == NULL || boxes[b]->type != pdf_array || boxes[b]->length != 4) {
+			if (b == 1) {
+				memcpy(crop, media, sizeof(crop));
+			}
+			continue;
+		}
+		int i;
+		for (i = 0; i < 4; i++) {
+			struct pdf_value_t *number = pdf_resolve(pdf, boxes[b]->items[i]);
+			values[b][i] = number != NULL && number->type == pdf_number ? number->number : 0;
+		}
+		// boxes may be given by any two opposite corners
+		double x1 = fmin(values[b][0], values[b][2]);
+		double y1 = fmin(values[b][1], values[b][3]);
+		double x2 = fmax(values[b][0], values[b][2]);
+		double y2 = fmax(values[b][1], values[b][3]);
+		values[b][0] = x1;
+		values[b][1] = y1;
+		values[b][2] = x2;
+		values[b][3] = y2;
+	}
+
+	box[0] = fmax(crop[0], media[0]);
+	box[1] = fmax(crop[1], media[1]);
+	box[2] = fmin(crop[2], media[2]);
+	box[3] = fmin(crop[3], media[3]);
+}
+
+// finds the images of page num if it only draws images that can be passed
+// through, or any images with any_image, returns how many
+// box is set to the page box the images are clipped to
+int passthrough_page_images(struct pages_t *pages, int num, double box[4], int any_image, struct passthrough_image_t **images) {
+	struct pdf_file_t *pdf = pages->pdf;
+	if (pdf == NULL || pdf_page_count(pdf) != pages->pool->npages) {
+		return -1;
+	}
+
+	struct pdf_value_t *page = pdf_page(pdf, num);
+	if (page == NULL) {
+		return -1;
+	}
+
+	// annotations are drawn when printing, rotated pages are turned by poppler
+	struct pdf_value_t *annots = pdf_dict_resolve(pdf, page, "Annots");
+	if (annots != NULL && annots->type == pdf_array && annots->length > 0) {
+		return -1;
+	}
+	if (pdf_integer(pdf, pdf_page_attribute(pdf, page, "Rotate"), 0) % 360 != 0) {
+		return -1;
+	}
+
+	size_t length;
+	unsigned char *content = pdf_page_contents(pdf, page, &length);
+	if (content == NULL) {
+		return -1;
+	}
+
+	// poppler draws the top left of the page box at the origin, y down
+	passthrough_page_box(pdf, page, box);
+	cairo_matrix_t base;
+	cairo_matrix_init(&base, 1, 0, 0, -1, -box[0], box[3]);
+
+	int nimages = passthrough_images(pdf, page, content, length, &base, any_image, images);
+	free(content);
+	return nimages;
+}
+
+// returns TRUE if draw_passthrough_page would draw page num
+int can_pass_through(struct pages_t *pages, int num) {
+	if (!pages->passthrough) {
+		return FALSE;
+	}
+	double box[4];
+	struct passthrough_image_t *images;
+	int nimages = passthrough_page_images(pages, num, box, FALSE, &images);
+	if (nimages <= 0) {
+		return FALSE;
+	}
+	free(images);
+	return TRUE;
+}
+
+// draws page num in page coordinates without decoding its images
+// returns FALSE if the page is not a scan that can be passed through
+int draw_passthrough_page(struct pages_t *pages, int num, cairo_t *cr) {
+	if (!pages->passthrough) {
+		return FALSE;
+	}
+	double box[4];
+	struct passthrough_image_t *images;
+	int nimages = passthrough_page_images(pages, num, box, FALSE, &images);
+	if (nimages <= 0) {
+		return FALSE;
+	}
+
+	// poppler clips to the page box
+	cairo_save(cr);
+	cairo_rectangle(cr, 0, 0, box[2] - box[0], box[3] - box[1]);
+	cairo_clip(cr);
+	int i;
+	for (i = 0; i < nimages; i++) {
+		draw_passthrough_image(cr, &images[i]);
+	}
+	cairo_restore(cr);
+
+	free(images);
+	pages->passthrough_pages++;
+	return TRUE;
+}
@@ -3,16 +3,14 @@
 void exit_if_cairo_surface_status_not_success(cairo_surface_t* surface, char* file, int line) {
 	cairo_status_t status = cairo_surface_status(surface);
 	if (status != CAIRO_STATUS_SUCCESS) {
-		printf("%s:%d: %s\n", file, line, cairo_status_to_string(status));
-		exit(1);
+		fail("%s:%d: %s", file, line, cairo_status_to_string(status));
 	}
 }
 
 void exit_if_cairo_status_not_success(cairo_t* cr, char* file, int line) {
 	cairo_status_t status = cairo_status(cr);
 	if (status != CAIRO_STATUS_SUCCESS) {
-		printf("%s:%d: %s\n", file, line, cairo_status_to_string(status));
-		exit(1);
+		fail("%s:%d: %s", file, line, cairo_status_to_string(status));
 	}
 }
 
@@ -43,6 +41,26 @@ void write_surface_to_file_showing_crop_box(char* filename, cairo_surface_t *rec
 	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
 }
 
+// the dates cairo writes are the only part of the output that changes from
+// run to run, use SOURCE_DATE_EPOCH or the epoch instead
+void set_deterministic_metadata(cairo_surface_t *surface) {
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 16, 0)
+	time_t epoch = 0;
+	char *source_date_epoch = getenv("SOURCE_DATE_EPOCH");
+	if (source_date_epoch != NULL) {
+		epoch = strtol(source_date_epoch, NULL, 10);
+	}
+
+	struct tm date;
+	gmtime_r(&epoch, &date);
+	char iso_date[32];
+	strftime(iso_date, sizeof(iso_date), "%Y-%m-%dT%H:%M:%SZ", &date);
+
+	cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_CREATE_DATE, iso_date);
+	cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_MOD_DATE, iso_date);
+#endif
+}
+
 // if PopplerDocument* is NULL, return error to user
 PopplerDocument* open_document(char* filename) {
 	// resolve path names
@@ -65,9 +83,29 @@ PopplerDocument* open_document(char* filename) {
 	free(uri);
 
 	if (document == NULL) {
-		printf("Could not open document %s\n", filename);
-		exit(1);
+		fail("Could not open document %s", filename);
+	}
+
+	return document;
+}
+
+// opens the input from memory or from its file
+PopplerDocument* open_input_document(struct options_t options) {
+	if (options.input_data == NULL) {
+		return open_document(options.input_filename);
 	}
 
+	PopplerDocument *document = poppler_document_new_from_data((char*) options.input_data, options.input_length, NULL, NULL);
+	if (document == NULL) {
+		fail("Could not open document from memory");
+	}
 	return document;
-}
\ No newline at end of file
+}
+
+// the input as read by pdfobj.c, NULL if it can not be read
+struct pdf_file_t* open_input_objects(struct options_t options) {
+	if (options.input_data == NULL) {
+		return pdf_file_open(options.input_filename);
+	}
+	return pdf_file_open_data(options.input_data, options.input_length);
+}
@@ -0,0 +1,1194 @@
+#include "all.h"
+
+// a small reader for the object structure of pdf files
+// poppler does not expose objects, streams or resources, so the parts of
+// bookmaker that need them (deduplicating the output, looking at the content
+// of input pages) read the file here
+// anything this reader does not understand makes it return NULL, callers
+// then fall back to what poppler and cairo do on their own
+
+#define PDF_MAX_DEPTH 64
+#define PDF_MAX_DECODED (256 << 20) // bytes a stream may decode to, larger ones are not read
+
+int is_pdf_whitespace(int c) {
+	return c == 0 || c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ';
+}
+
+int is_pdf_delimiter(int c) {
+	return c != 0 && strchr("()<>[]{}/%", c) != NULL;
+}
+
+void pdf_skip_whitespace(struct pdf_lexer_t *lexer) {
+	while (lexer->pos < lexer->size) {
+		int c = lexer->data[lexer->pos];
+		if (is_pdf_whitespace(c)) {
+			lexer->pos++;
+		} else if (c == '%') {
+			// comment to the end of the line
+			while (lexer->pos < lexer->size && lexer->data[lexer->pos] != '\n' && lexer->data[lexer->pos] != '\r') {
+				lexer->pos++;
+			}
+		} else {
+			break;
+		}
+	}
+}
+
+// reads the next token, returns FALSE at the end of the data
+int pdf_next_token(struct pdf_lexer_t *lexer, struct pdf_token_t *token) {
+	pdf_skip_whitespace(lexer);
+
+	const unsigned char *data = lexer->data;
+	size_t start = lexer->pos;
+	token->start = data + start;
+	token->length = 0;
+
+	if (start >= lexer->size) {
+		token->type = token_eof;
+		return FALSE;
+	}
+
+	size_t pos = start;
+	int c = data[pos];
+	switch (c) {
+	case '[':
+		token->type = token_array_open;
+		pos++;
+		break;
+	case ']':
+		token->type = token_array_close;
+		pos++;
+		break;
+	case '<':
+		if (pos + 1 < lexer->size && data[pos + 1] == '<') {
+			token->type = token_dict_open;
+			pos += 2;
+		} else {
+			token->type = token_hex_string;
+			while (pos < lexer->size && data[pos] != '>') {
+				pos++;
+			}
+			pos++;
+		}
+		break;
+	case '>':
+		if (pos + 1 < lexer->size && data[pos + 1] == '>') {
+			token->type = token_dict_close;
+			pos += 2;
+		} else {
+			token->type = token_keyword;
+			pos++;
+		}
+		break;
+	case '(': {
+		int depth = 0;
+		token->type = token_string;
+		while (pos < lexer->size) {
+			c = data[pos++];
+			if (c == '\\') {
+				pos++;
+			} else if (c == '(') {
+				depth++;
+			} else if (c == ')') {
+				depth--;
+				if (depth == 0) {
+					break;
+				}
+			}
+		}
+		break;
+	}
+	case '/':
+		token->type = token_name;
+		pos++;
+		while (pos < lexer->size && !is_pdf_whitespace(data[pos]) && !is_pdf_delimiter(data[pos])) {
+			pos++;
+		}
+		break;
+	case '{':
+	case '}':
+	case ')':
+		token->type = token_keyword;
+		pos++;
+		break;
+	default:
+		while (pos < lexer->size && !is_pdf_whitespace(data[pos]) && !is_pdf_delimiter(data[pos])) {
+			pos++;
+		}
+		token->type = token_number;
+		size_t i;
+		for (i = start; i < pos; i++) {
+			if (strchr("+-.0123456789", data[i]) == NULL) {
+				token->type = token_keyword;
+				break;
+			}
+		}
+	}
+
+	if (pos > lexer->size) {
+		pos = lexer->size;
+	}
+	lexer->pos = pos;
+	token->length = pos - start;
+	return TRUE;
+}
+
+int pdf_token_is(struct pdf_token_t *token, const char *keyword) {
+	return token->type == token_keyword
+		&& token->length == strlen(keyword)
+		&& memcmp(token->start, keyword, token->length) == 0;
+}
+
+double pdf_token_number(struct pdf_token_t *token) {
+	char buffer[64];
+	size_t length = token->length < sizeof(buffer) - 1 ? token->length : sizeof(buffer) - 1;
+	memcpy(buffer, token->start, length);
+	buffer[length] = 0;
+	return strtod(buffer, NULL);
+}
+
+int pdf_token_is_integer(struct pdf_token_t *token) {
+	if (token->type != token_number || token->length == 0) {
+		return FALSE;
+	}
+	size_t i;
+	for (i = 0; i < token->length; i++) {
+		if (token->start[i] < '0' || token->start[i] > '9') {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+int hex_digit(int c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+char* pdf_decode_name(struct pdf_token_t *token) {
+	char *name = malloc(token->length);
+	size_t in, out = 0;
+	for (in = 1; in < token->length; in++) {
+		int c = token->start[in];
+		if (c == '#' && in + 2 < token->length && hex_digit(token->start[in + 1]) >= 0 && hex_digit(token->start[in + 2]) >= 0) {
+			c = hex_digit(token->start[in + 1]) * 16 + hex_digit(token->start[in + 2]);
+			in += 2;
+		}
+		name[out++] = c;
+	}
+	name[out] = 0;
+	return name;
+}
+
+char* pdf_decode_string(struct pdf_token_t *token, int *length) {
+	char *string = malloc(token->length + 1);
+	size_t in, out = 0;
+
+	if (token->type == token_hex_string) {
+		int high = -1;
+		for (in = 1; in < token->length; in++) {
+			int digit = hex_digit(token->start[in]);
+			if (digit < 0) {
+				continue;
+			}
+			if (high < 0) {
+				high = digit;
+			} else {
+				string[out++] = high * 16 + digit;
+				high = -1;
+			}
+		}
+		if (high >= 0) {
+			string[out++] = high * 16;
+		}
+	} else {
+		size_t end = token->length > 1 ? token->length - 1 : 1;
+		for (in = 1; in < end; in++) {
+			int c = token->start[in];
+			if (c == '\\' && in + 1 < end) {
+				c = token->start[++in];
+				switch (c) {
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case '\r':
+					if (in + 1 < end && token->start[in + 1] == '\n') {
+						in++;
+					}
+					continue;
+				case '\n':
+					continue;
+				default:
+					if (c >= '0' && c <= '7') {
+						int value = c - '0';
+						int digits = 1;
+						while (digits < 3 && in + 1 < end && token->start[in + 1] >= '0' && token->start[in + 1] <= '7') {
+							value = value * 8 + token->start[++in] - '0';
+							digits++;
+						}
+						c = value & 0xff;
+					}
+				}
+			}
+			string[out++] = c;
+		}
+	}
+
+	string[out] = 0;
+	*length = out;
+	return string;
+}
+
+struct pdf_value_t* pdf_new_value(enum pdf_type_t type) {
+	struct pdf_value_t *value = calloc(1, sizeof(struct pdf_value_t));
+	value->type = type;
+	return value;
+}
+
+void pdf_value_free(struct pdf_value_t *value) {
+	if (value == NULL) {
+		return;
+	}
+
+	int i;
+	for (i = 0; i < value->length; i++) {
+		if (value->items != NULL) {
+			pdf_value_free(value->items[i]);
+		}
+		if (value->keys != NULL) {
+			free(value->keys[i]);
+		}
+	}
+	free(value->items);
+	free(value->keys);
+	free(value->string);
+	free(value);
+}
+
+void pdf_append(struct pdf_value_t *container, char *key, struct pdf_value_t *item) {
+	if (container->length == container->allocated) {
+		container->allocated = container->allocated ? container->allocated * 2 : 8;
+		container->items = realloc(container->items, sizeof(struct pdf_value_t*) * container->allocated);
+		if (container->type == pdf_dict) {
+			container->keys = realloc(container->keys, sizeof(char*) * container->allocated);
+		}
+	}
+	if (container->type == pdf_dict) {
+		container->keys[container->length] = key;
+	}
+	container->items[container->length] = item;
+	container->length++;
+}
+
+struct pdf_value_t* pdf_parse_token(struct pdf_lexer_t *lexer, struct pdf_token_t *token, int depth) {
+	if (depth > PDF_MAX_DEPTH) {
+		return NULL;
+	}
+
+	struct pdf_value_t *value = NULL;
+	struct pdf_token_t next;
+	switch (token->type) {
+	case token_number: {
+		// integers followed by an integer and R are references
+		if (pdf_token_is_integer(token)) {
+			size_t saved = lexer->pos;
+			struct pdf_token_t gen;
+			if (pdf_next_token(lexer, &gen) && pdf_token_is_integer(&gen)
+					&& pdf_next_token(lexer, &next) && pdf_token_is(&next, "R")) {
+				value = pdf_new_value(pdf_ref);
+				value->num = (int) pdf_token_number(token);
+				value->gen = (int) pdf_token_number(&gen);
+				return value;
+			}
+			lexer->pos = saved;
+		}
+		value = pdf_new_value(pdf_number);
+		value->number = pdf_token_number(token);
+		return value;
+	}
+	case token_name:
+		value = pdf_new_value(pdf_name);
+		value->string = pdf_decode_name(token);
+		return value;
+	case token_string:
+	case token_hex_string:
+		value = pdf_new_value(pdf_string);
+		value->string = pdf_decode_string(token, &value->length);
+		return value;
+	case token_array_open:
+		value = pdf_new_value(pdf_array);
+		while (pdf_next_token(lexer, &next) && next.type != token_array_close) {
+			struct pdf_value_t *item = pdf_parse_token(lexer, &next, depth + 1);
+			if (item == NULL) {
+				pdf_value_free(value);
+				return NULL;
+			}
+			pdf_append(value, NULL, item);
+		}
+		if (next.type != token_array_close) {
+			pdf_value_free(value);
+			return NULL;
+		}
+		return value;
+	case token_dict_open:
+		value = pdf_new_value(pdf_dict);
+		while (pdf_next_token(lexer, &next) && next.type == token_name) {
+			char *key = pdf_decode_name(&next);
+			struct pdf_token_t item_token;
+			struct pdf_value_t *item = NULL;
+			if (pdf_next_token(lexer, &item_token)) {
+				item = pdf_parse_token(lexer, &item_token, depth + 1);
+			}
+			if (item == NULL) {
+				free(key);
+				pdf_value_free(value);
+				return NULL;
+			}
+			pdf_append(value, key, item);
+		}
+		if (next.type != token_dict_close) {
+			pdf_value_free(value);
+			return NULL;
+		}
+		return value;
+	case token_keyword:
+		if (pdf_token_is(token, "true") || pdf_token_is(token, "false")) {
+			value = pdf_new_value(pdf_bool);
+			value->number = pdf_token_is(token, "true");
+			return value;
+		}
+		if (pdf_token_is(token, "null")) {
+			return pdf_new_value(pdf_null);
+		}
+		return NULL;
+	default:
+		return NULL;
+	}
+}
+
+struct pdf_value_t* pdf_parse_value(struct pdf_lexer_t *lexer) {
+	struct pdf_token_t token;
+	if (!pdf_next_token(lexer, &token)) {
+		return NULL;
+	}
+	return pdf_parse_token(lexer, &token, 0);
+}
+
+// returns the entry for key in a dictionary or stream dictionary, or NULL
+struct pdf_value_t* pdf_dict_get(struct pdf_value_t *dict, const char *key) {
+	if (dict == NULL || (dict->type != pdf_dict && dict->type != pdf_stream)) {
+		return NULL;
+	}
+
+	int i;
+	for (i = 0; i < dict->length; i++) {
+		if (strcmp(dict->keys[i], key) == 0) {
+			return dict->items[i];
+		}
+	}
+	return NULL;
+}
+
+int pdf_is_name(struct pdf_value_t *value, const char *name) {
+	return value != NULL && value->type == pdf_name && strcmp(value->string, name) == 0;
+}
+
+struct pdf_value_t* pdf_resolve(struct pdf_file_t *file, struct pdf_value_t *value) {
+	int depth = 0;
+	while (value != NULL && value->type == pdf_ref && depth++ < PDF_MAX_DEPTH) {
+		value = pdf_get_object(file, value->num);
+	}
+	return value;
+}
+
+struct pdf_value_t* pdf_dict_resolve(struct pdf_file_t *file, struct pdf_value_t *dict, const char *key) {
+	return pdf_resolve(file, pdf_dict_get(dict, key));
+}
+
+// makes sure the xref table has room for object num
+void pdf_grow_xref(struct pdf_file_t *file, int num) {
+	if (num < file->nobjects) {
+		return;
+	}
+
+	int nobjects = file->nobjects ? file->nobjects : 64;
+	while (nobjects <= num) {
+		nobjects *= 2;
+	}
+	file->xref = realloc(file->xref, sizeof(struct pdf_xref_t) * nobjects);
+	file->objects = realloc(file->objects, sizeof(struct pdf_value_t*) * nobjects);
+	memset(file->xref + file->nobjects, 0, sizeof(struct pdf_xref_t) * (nobjects - file->nobjects));
+	memset(file->objects + file->nobjects, 0, sizeof(struct pdf_value_t*) * (nobjects - file->nobjects));
+	file->nobjects = nobjects;
+}
+
+// entries from newer sections are read first and win over older ones
+void pdf_set_xref(struct pdf_file_t *file, int num, char type, size_t offset, int gen, int stream_num, int index) {
+	if (num < 0 || num > 8388607) {
+		return;
+	}
+	pdf_grow_xref(file, num);
+
+	struct pdf_xref_t *entry = &file->xref[num];
+	if (entry->type != 0) {
+		return;
+	}
+	entry->type = type;
+	entry->offset = offset;
+	entry->gen = gen;
+	entry->stream_num = stream_num;
+	entry->index = index;
+}
+
+long pdf_integer(struct pdf_file_t *file, struct pdf_value_t *value, long fallback) {
+	value = pdf_resolve(file, value);
+	if (value == NULL || value->type != pdf_number) {
+		return fallback;
+	}
+	return (long) value->number;
+}
+
+// parses "num gen obj value [stream ... endstream] endobj" at offset
+// stream data is not copied, the value points into data
+struct pdf_value_t* pdf_parse_indirect(struct pdf_file_t *file, const unsigned char *data, size_t size, size_t offset, int *num, size_t *end) {
+	struct pdf_lexer_t lexer = {data, offset, size};
+	struct pdf_token_t num_token, gen_token, obj_token;
+
+	if (!pdf_next_token(&lexer, &num_token) || !pdf_token_is_integer(&num_token)
+			|| !pdf_next_token(&lexer, &gen_token) || !pdf_token_is_integer(&gen_token)
+			|| !pdf_next_token(&lexer, &obj_token) || !pdf_token_is(&obj_token, "obj")) {
+		return NULL;
+	}
+	if (num != NULL) {
+		*num = (int) pdf_token_number(&num_token);
+	}
+
+	struct pdf_value_t *value = pdf_parse_value(&lexer);
+	if (value == NULL) {
+		return NULL;
+	}
+
+	size_t after_value = lexer.pos;
+	struct pdf_token_t token;
+	if (value->type == pdf_dict && pdf_next_token(&lexer, &token) && pdf_token_is(&token, "stream")) {
+		size_t start = lexer.pos;
+		if (start < size && data[start] == '\r') {
+			start++;
+		}
+		if (start < size && data[start] == '\n') {
+			start++;
+		}
+
+		// the length may be a reference to an object that comes later
+		long length = pdf_integer(file, pdf_dict_get(value, "Length"), -1);
+		int length_ok = length >= 0 && start + length <= size;
+		if (length_ok) {
+			struct pdf_lexer_t check = {data, start + length, size};
+			length_ok = pdf_next_token(&check, &token) && pdf_token_is(&token, "endstream");
+		}
+		if (!length_ok) {
+			// wrong or missing length, look for the end of the stream instead
+			const unsigned char *found = memmem(data + start, size - start, "endstream", 9);
+			if (found == NULL) {
+				pdf_value_free(value);
+				return NULL;
+			}
+			length = found - (data + start);
+			while (length > 0 && (data[start + length - 1] == '\n' || data[start + length - 1] == '\r')) {
+				length--;
+			}
+		}
+
+		value->type = pdf_stream;
+		value->stream = data + start;
+		value->stream_length = length;
+
+		lexer.pos = start + length;
+		pdf_next_token(&lexer, &token); // endstream
+		after_value = lexer.pos;
+	} else {
+		lexer.pos = after_value;
+	}
+
+	if (pdf_next_token(&lexer, &token) && pdf_token_is(&token, "endobj")) {
+		after_value = lexer.pos;
+	}
+	if (end != NULL) {
+		*end = after_value;
+	}
+	return value;
+}
+
+// decoded contents of the object stream num, kept for later lookups
+unsigned char* pdf_object_stream(struct pdf_file_t *file, int num, size_t *length) {
+	struct pdf_xref_t *entry = &file->xref[num];
+	if (entry->decoded == NULL) {
+		struct pdf_value_t *stream = pdf_get_object(file, num);
+		if (stream == NULL || stream->type != pdf_stream) {
+			return NULL;
+		}
+		entry->decoded = pdf_stream_decode(file, stream, &entry->decoded_length);
+	}
+	*length = entry->decoded_length;
+	return entry->decoded;
+}
+
+struct pdf_value_t* pdf_parse_compressed(struct pdf_file_t *file, struct pdf_xref_t *entry) {
+	if (entry->stream_num < 0 || entry->stream_num >= file->nobjects || file->xref[entry->stream_num].type != 'n') {
+		return NULL;
+	}
+
+	struct pdf_value_t *stream = pdf_get_object(file, entry->stream_num);
+	long n = pdf_integer(file, pdf_dict_get(stream, "N"), 0);
+	long first = pdf_integer(file, pdf_dict_get(stream, "First"), 0);
+	if (entry->index >= n) {
+		return NULL;
+	}
+
+	size_t length;
+	unsigned char *data = pdf_object_stream(file, entry->stream_num, &length);
+	if (data == NULL || first > length) {
+		return NULL;
+	}
+
+	// the stream starts with pairs of object numbers and offsets
+	struct pdf_lexer_t lexer = {data, 0, first};
+	struct pdf_token_t token;
+	long offset = -1;
+	int i;
+	for (i = 0; i <= entry->index; i++) {
+		if (!pdf_next_token(&lexer, &token) || !pdf_next_token(&lexer, &token)) {
+			return NULL;
+		}
+		offset = (long) pdf_token_number(&token);
+	}
+	if (offset < 0 || first + offset >= length) {
+		return NULL;
+	}
+
+	struct pdf_lexer_t object = {data, first + offset, length};
+	return pdf_parse_value(&object);
+}
+
+// returns object num, owned by the file, or NULL if it can not be read
+struct pdf_value_t* pdf_get_object(struct pdf_file_t *file, int num) {
+	if (num <= 0 || num >= file->nobjects) {
+		return NULL;
+	}
+	if (file->objects[num] != NULL) {
+		return file->objects[num];
+	}
+
+	struct pdf_xref_t *entry = &file->xref[num];
+	if (entry->loading) {
+		// reference cycle, e.g. a stream whose length refers to itself
+		return NULL;
+	}
+	entry->loading = TRUE;
+
+	struct pdf_value_t *value = NULL;
+	switch (entry->type) {
+	case 'n':
+		if (entry->offset < file->size) {
+			value = pdf_parse_indirect(file, file->data, file->size, entry->offset, NULL, &entry->end);
+		}
+		break;
+	case 'c':
+		value = pdf_parse_compressed(file, entry);
+		break;
+	}
+
+	entry->loading = FALSE;
+	file->objects[num] = value;
+	return value;
+}
+
+int pdf_read_xref(struct pdf_file_t *file, size_t offset, int depth);
+
+int pdf_read_xref_table(struct pdf_file_t *file, struct pdf_lexer_t *lexer, int depth) {
+	struct pdf_token_t token;
+	while (pdf_next_token(lexer, &token) && pdf_token_is_integer(&token)) {
+		int start = (int) pdf_token_number(&token);
+		if (!pdf_next_token(lexer, &token) || !pdf_token_is_integer(&token)) {
+			return FALSE;
+		}
+		int count = (int) pdf_token_number(&token);
+
+		int i;
+		for (i = 0; i < count; i++) {
+			struct pdf_token_t offset_token, gen_token, type_token;
+			if (!pdf_next_token(lexer, &offset_token) || !pdf_next_token(lexer, &gen_token) || !pdf_next_token(lexer, &type_token)) {
+				return FALSE;
+			}
+			char type = pdf_token_is(&type_token, "n") ? 'n' : 'f';
+			pdf_set_xref(file, start + i, type, (size_t) pdf_token_number(&offset_token), (int) pdf_token_number(&gen_token), -1, 0);
+		}
+	}
+
+	if (!pdf_token_is(&token, "trailer")) {
+		return FALSE;
+	}
+	struct pdf_value_t *trailer = pdf_parse_value(lexer);
+	if (trailer == NULL || trailer->type != pdf_dict) {
+		pdf_value_free(trailer);
+		return FALSE;
+	}
+
+	// hybrid files keep the newer entries in an xref stream
+	long xref_stream = pdf_integer(file, pdf_dict_get(trailer, "XRefStm"), -1);
+	if (xref_stream >= 0) {
+		pdf_read_xref(file, xref_stream, depth + 1);
+	}
+
+	long prev = pdf_integer(file, pdf_dict_get(trailer, "Prev"), -1);
+	if (file->trailer == NULL) {
+		file->trailer = trailer;
+	} else {
+		pdf_value_free(trailer);
+	}
+	if (prev >= 0) {
+		return pdf_read_xref(file, prev, depth + 1);
+	}
+	return TRUE;
+}
+
+int pdf_read_xref_stream(struct pdf_file_t *file, struct pdf_value_t *stream, int depth) {
+	struct pdf_value_t *widths = pdf_dict_get(stream, "W");
+	if (widths == NULL || widths->type != pdf_array || widths->length != 3) {
+		return FALSE;
+	}
+	int w[3];
+	int i;
+	for (i = 0; i < 3; i++) {
+		w[i] = (int) pdf_integer(file, widths->items[i], -1);
+		if (w[i] < 0 || w[i] > 8) {
+			return FALSE;
+		}
+	}
+	int entry_size = w[0] + w[1] + w[2];
+	if (entry_size == 0) {
+		return FALSE;
+	}
+
+	size_t length;
+	unsigned char *data = pdf_stream_decode(file, stream, &length);
+	if (data == NULL) {
+		return FALSE;
+	}
+
+	long size = pdf_integer(file, pdf_dict_get(stream, "Size"), 0);
+	struct pdf_value_t *index = pdf_dict_get(stream, "Index");
+	int nsections = 1;
+	if (index != NULL && index->type == pdf_array) {
+		nsections = index->length / 2;
+	}
+
+	size_t pos = 0;
+	int section;
+	for (section = 0; section < nsections; section++) {
+		long start = 0;
+		long count = size;
+		if (index != NULL && index->type == pdf_array) {
+			start = pdf_integer(file, index->items[2*section], 0);
+			count = pdf_integer(file, index->items[2*section + 1], 0);
+		}
+
+		long n;
+		for (n = 0; n < count && pos + entry_size <= length; n++) {
+			unsigned long fields[3];
+			int field;
+			for (field = 0; field < 3; field++) {
+				fields[field] = 0;
+				int byte;
+				for (byte = 0; byte < w[field]; byte++) {
+					fields[field] = (fields[field] << 8) | data[pos++];
+				}
+			}
+			if (w[0] == 0) {
+				fields[0] = 1; // type defaults to in use
+			}
+
+			switch (fields[0]) {
+			case 0:
+				pdf_set_xref(file, start + n, 'f', 0, (int) fields[2], -1, 0);
+				break;
+			case 1:
+				pdf_set_xref(file, start + n, 'n', fields[1], (int) fields[2], -1, 0);
+				break;
+			case 2:
+				pdf_set_xref(file, start + n, 'c', 0, 0, (int) fields[1], (int) fields[2]);
+				break;
+			}
+		}
+	}
+	free(data);
+
+	file->has_xref_stream = TRUE;
+	return TRUE;
+}
+
+int pdf_read_xref(struct pdf_file_t *file, size_t offset, int depth) {
+	if (depth > PDF_MAX_DEPTH || offset >= file->size) {
+		return FALSE;
+	}
+
+	struct pdf_lexer_t lexer = {file->data, offset, file->size};
+	struct pdf_token_t token;
+	if (!pdf_next_token(&lexer, &token)) {
+		return FALSE;
+	}
+	if (pdf_token_is(&token, "xref")) {
+		return pdf_read_xref_table(file, &lexer, depth);
+	}
+
+	// an xref stream is an ordinary stream object, it carries the trailer entries
+	struct pdf_value_t *stream = pdf_parse_indirect(file, file->data, file->size, offset, NULL, NULL);
+	if (stream == NULL || stream->type != pdf_stream || !pdf_is_name(pdf_dict_get(stream, "Type"), "XRef")) {
+		pdf_value_free(stream);
+		return FALSE;
+	}
+	int ok = pdf_read_xref_stream(file, stream, depth);
+
+	long prev = pdf_integer(file, pdf_dict_get(stream, "Prev"), -1);
+	if (file->trailer == NULL) {
+		stream->type = pdf_dict;
+		stream->stream = NULL;
+		stream->stream_length = 0;
+		file->trailer = stream;
+	} else {
+		pdf_value_free(stream);
+	}
+	if (ok && prev >= 0) {
+		return pdf_read_xref(file, prev, depth + 1);
+	}
+	return ok;
+}
+
+// damaged files: find every "num gen obj" and the last trailer
+void pdf_reconstruct_xref(struct pdf_file_t *file) {
+	int i;
+	for (i = 0; i < file->nobjects; i++) {
+		file->xref[i].type = 0;
+	}
+	pdf_value_free(file->trailer);
+	file->trailer = NULL;
+
+	const unsigned char *data = file->data;
+	const unsigned char *found = data;
+	while ((found = memmem(found, file->size - (found - data), "obj", 3)) != NULL) {
+		// walk back over "num gen " in front of obj
+		const unsigned char *start = found;
+		int fields = 0;
+		while (start > data && fields < 2) {
+			while (start > data && is_pdf_whitespace(start[-1])) {
+				start--;
+			}
+			const unsigned char *digits = start;
+			while (start > data && start[-1] >= '0' && start[-1] <= '9') {
+				start--;
+			}
+			if (start == digits) {
+				break;
+			}
+			fields++;
+		}
+		if (fields == 2 && (start == data || is_pdf_whitespace(start[-1]))) {
+			int num = atoi((const char*) start);
+			// later definitions of an object replace earlier ones
+			if (num > 0 && num < 8388607) {
+				pdf_grow_xref(file, num);
+				file->xref[num].type = 0;
+				pdf_set_xref(file, num, 'n', start - data, 0, -1, 0);
+			}
+		}
+		found += 3;
+	}
+
+	const unsigned char *trailer = NULL;
+	found = data;
+	while ((found = memmem(found, file->size - (found - data), "trailer", 7)) != NULL) {
+		trailer = found;
+		found += 7;
+	}
+	if (trailer != NULL) {
+		struct pdf_lexer_t lexer = {data, trailer - data + 7, file->size};
+		file->trailer = pdf_parse_value(&lexer);
+	}
+}
+
+struct pdf_file_t* pdf_file_open_data(const unsigned char *data, size_t size) {
+	struct pdf_file_t *file = calloc(1, sizeof(struct pdf_file_t));
+	file->data = data;
+	file->size = size;
+
+	// the xref offset follows the last startxref
+	size_t tail = size > 1024 ? size - 1024 : 0;
+	const unsigned char *startxref = NULL;
+	const unsigned char *found = data + tail;
+	while ((found = memmem(found, size - (found - data), "startxref", 9)) != NULL) {
+		startxref = found;
+		found += 9;
+	}
+
+	int ok = FALSE;
+	if (startxref != NULL) {
+		struct pdf_lexer_t lexer = {data, startxref - data + 9, size};
+		struct pdf_token_t token;
+		if (pdf_next_token(&lexer, &token) && pdf_token_is_integer(&token)) {
+			ok = pdf_read_xref(file, (size_t) pdf_token_number(&token), 0);
+		}
+	}
+	if (!ok || file->trailer == NULL) {
+		pdf_reconstruct_xref(file);
+	}
+
+	// encrypted streams can not be read without the key
+	if (file->trailer == NULL || file->trailer->type != pdf_dict || pdf_dict_get(file->trailer, "Encrypt") != NULL) {
+		pdf_file_free(file);
+		return NULL;
+	}
+	return file;
+}
+
+// reads the whole file into memory, returns NULL if it can not be read
+struct pdf_file_t* pdf_file_open(const char *filename) {
+	FILE *input = fopen(filename, "rb");
+	if (input == NULL) {
+		return NULL;
+	}
+
+	struct stat filestat;
+	if (fstat(fileno(input), &filestat) == -1) {
+		fclose(input);
+		return NULL;
+	}
+
+	unsigned char *data = malloc(filestat.st_size + 1);
+	size_t size = fread(data, 1, filestat.st_size, input);
+	fclose(input);
+
+	struct pdf_file_t *file = pdf_file_open_data(data, size);
+	if (file == NULL) {
+		free(data);
+		return NULL;
+	}
+	file->owns_data = TRUE;
+	return file;
+}
+
+void pdf_file_free(struct pdf_file_t *file) {
+	int i;
+	for (i = 0; i < file->nobjects; i++) {
+		pdf_value_free(file->objects[i]);
+		free(file->xref[i].decoded);
+	}
+	free(file->objects);
+	free(file->xref);
+	free(file->pages);
+	pdf_value_free(file->trailer);
+	if (file->owns_data) {
+		free((unsigned char*) file->data);
+	}
+	free(file);
+}
+
+// visited marks the nodes already walked, so a node listed twice or its own
+// kid is only walked once
+void pdf_add_pages(struct pdf_file_t *file, struct pdf_value_t *node, int num, int depth, char *visited) {
+	if (node == NULL || depth > PDF_MAX_DEPTH || visited[num]) {
+		return;
+	}
+	visited[num] = TRUE;
+
+	struct pdf_value_t *kids = pdf_dict_resolve(file, node, "Kids");
+	if (kids == NULL || kids->type != pdf_array) {
+		// a leaf of the page tree
+		if (file->npages == file->allocated_pages) {
+			file->allocated_pages = file->allocated_pages ? file->allocated_pages * 2 : 64;
+			file->pages = realloc(file->pages, sizeof(int) * file->allocated_pages);
+		}
+		file->pages[file->npages++] = num;
+		return;
+	}
+
+	int i;
+	for (i = 0; i < kids->length; i++) {
+		struct pdf_value_t *kid = kids->items[i];
+		if (kid->type == pdf_ref) {
+			pdf_add_pages(file, pdf_get_object(file, kid->num), kid->num, depth + 1, visited);
+		}
+	}
+}
+
+// returns the number of pages found in the page tree
+int pdf_page_count(struct pdf_file_t *file) {
+	if (file->pages == NULL) {
+		struct pdf_value_t *catalog = pdf_dict_resolve(file, file->trailer, "Root");
+		struct pdf_value_t *root = pdf_dict_get(catalog, "Pages");
+		if (root != NULL && root->type == pdf_ref) {
+			// objects that exist are numbered below nobjects, see pdf_get_object
+			char *visited = calloc(file->nobjects, sizeof(char));
+			pdf_add_pages(file, pdf_get_object(file, root->num), root->num, 0, visited);
+			free(visited);
+		}
+		if (file->pages == NULL) {
+			file->pages = malloc(sizeof(int));
+		}
+	}
+	return file->npages;
+}
+
+// returns the page dictionary of page index, 0 based like poppler
+struct pdf_value_t* pdf_page(struct pdf_file_t *file, int index) {
+	if (index < 0 || index >= pdf_page_count(file)) {
+		return NULL;
+	}
+	return pdf_get_object(file, file->pages[index]);
+}
+
+// looks up key on the page or the page tree nodes above it
+struct pdf_value_t* pdf_page_attribute(struct pdf_file_t *file, struct pdf_value_t *page, const char *key) {
+	int depth;
+	for (depth = 0; page != NULL && depth < PDF_MAX_DEPTH; depth++) {
+		struct pdf_value_t *value = pdf_dict_resolve(file, page, key);
+		if (value != NULL) {
+			return value;
+		}
+		page = pdf_dict_resolve(file, page, "Parent");
+	}
+	return NULL;
+}
+
+// returns all content streams of the page decoded and joined, NULL if one
+// of them can not be decoded
+unsigned char* pdf_page_contents(struct pdf_file_t *file, struct pdf_value_t *page, size_t *length) {
+	struct pdf_value_t *contents = pdf_dict_resolve(file, page, "Contents");
+
+	int nstreams = 0;
+	struct pdf_value_t **streams = NULL;
+	if (contents != NULL && contents->type == pdf_array) {
+		nstreams = contents->length;
+		streams = contents->items;
+	} else if (contents != NULL) {
+		nstreams = 1;
+		streams = &contents;
+	}
+
+	unsigned char *joined = malloc(1);
+	*length = 0;
+	int i;
+	for (i = 0; i < nstreams; i++) {
+		size_t stream_length;
+		unsigned char *data = pdf_stream_decode(file, pdf_resolve(file, streams[i]), &stream_length);
+		if (data == NULL) {
+			free(joined);
+			return NULL;
+		}
+
+		// streams are joined with whitespace between them
+		joined = realloc(joined, *length + stream_length + 1);
+		memcpy(joined + *length, data, stream_length);
+		*length += stream_length;
+		joined[(*length)++] = '\n';
+		free(data);
+	}
+	return joined;
+}
+
+// skips the data of an inline image, the lexer is just after the ID operator
+void pdf_skip_inline_image(struct pdf_lexer_t *lexer) {
+	size_t pos = lexer->pos + 1;
+	while (pos + 2 <= lexer->size) {
+		if (lexer->data[pos] == 'E' && lexer->data[pos + 1] == 'I'
+				&& is_pdf_whitespace(lexer->data[pos - 1])
+				&& (pos + 2 == lexer->size || is_pdf_whitespace(lexer->data[pos + 2]))) {
+			lexer->pos = pos + 2;
+			return;
+		}
+		pos++;
+	}
+	lexer->pos = lexer->size;
+}
+
+unsigned char* pdf_inflate(const unsigned char *data, size_t length, size_t *decoded_length) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK) {
+		return NULL;
+	}
+
+	size_t allocated = length * 4 + 1024;
+	if (allocated > PDF_MAX_DECODED) {
+		allocated = PDF_MAX_DECODED;
+	}
+	unsigned char *decoded = malloc(allocated);
+	stream.next_in = (unsigned char*) data;
+	stream.avail_in = length;
+
+	int status;
+	do {
+		if (stream.total_out == allocated) {
+			// a few bytes of deflate can decode to more than fits in memory
+			if (allocated >= PDF_MAX_DECODED) {
+				free(decoded);
+				inflateEnd(&stream);
+				return NULL;
+			}
+			allocated *= 2;
+			if (allocated > PDF_MAX_DECODED) {
+				allocated = PDF_MAX_DECODED;
+			}
+			decoded = realloc(decoded, allocated);
+		}
+		stream.next_out = decoded + stream.total_out;
+		stream.avail_out = allocated - stream.total_out;
+		status = inflate(&stream, Z_NO_FLUSH);
+	} while (status == Z_OK);
+
+	*decoded_length = stream.total_out;
+	inflateEnd(&stream);
+
+	// keep what could be decoded from truncated streams
+	if (status != Z_STREAM_END && status != Z_BUF_ERROR && stream.total_out == 0) {
+		free(decoded);
+		return NULL;
+	}
+	return decoded;
+}
+
+// undoes png predictors, rows of columns*colors*bits/8 bytes with a tag byte in front
+unsigned char* pdf_unpredict(struct pdf_file_t *file, struct pdf_value_t *parms, unsigned char *data, size_t *length) {
+	long predictor = pdf_integer(file, pdf_dict_get(parms, "Predictor"), 1);
+	if (predictor == 1) {
+		return data;
+	}
+	if (predictor < 10) {
+		// tiff predictor
+		free(data);
+		return NULL;
+	}
+
+	long colors = pdf_integer(file, pdf_dict_get(parms, "Colors"), 1);
+	long bits = pdf_integer(file, pdf_dict_get(parms, "BitsPerComponent"), 8);
+	long columns = pdf_integer(file, pdf_dict_get(parms, "Columns"), 1);
+	long bpp = (colors * bits + 7) / 8;
+	long row_length = (columns * colors * bits + 7) / 8;
+	if (bpp <= 0 || row_length <= 0) {
+		free(data);
+		return NULL;
+	}
+
+	long rows = *length / (row_length + 1);
+	unsigned char *out = calloc(rows + 1, row_length);
+	unsigned char *previous = calloc(1, row_length);
+	long row, i;
+	for (row = 0; row < rows; row++) {
+		unsigned char *in = data + row * (row_length + 1);
+		unsigned char *current = out + row * row_length;
+		int tag = in[0];
+		in++;
+		for (i = 0; i < row_length; i++) {
+			int left = i >= bpp ? current[i - bpp] : 0;
+			int up = previous[i];
+			int up_left = i >= bpp ? previous[i - bpp] : 0;
+			int value = in[i];
+			switch (tag) {
+			case 1:
+				value += left;
+				break;
+			case 2:
+				value += up;
+				break;
+			case 3:
+				value += (left + up) / 2;
+				break;
+			case 4: {
+				int p = left + up - up_left;
+				int pa = abs(p - left);
+				int pb = abs(p - up);
+				int pc = abs(p - up_left);
+				value += (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : up_left);
+				break;
+			}
+			}
+			current[i] = value;
+		}
+		memcpy(previous, current, row_length);
+	}
+
+	free(previous);
+	free(data);
+	*length = rows * row_length;
+	return out;
+}
+
+// returns the decoded stream data in a new buffer
+// NULL if one of the filters is not supported
+unsigned char* pdf_stream_decode(struct pdf_file_t *file, struct pdf_value_t *stream, size_t *length) {
+	if (stream == NULL || stream->type != pdf_stream) {
+		return NULL;
+	}
+
+	struct pdf_value_t *filter = pdf_dict_resolve(file, stream, "Filter");
+	struct pdf_value_t *parms = pdf_dict_resolve(file, stream, "DecodeParms");
+
+	int nfilters = 0;
+	struct pdf_value_t **filters = NULL;
+	if (filter != NULL && filter->type == pdf_array) {
+		nfilters = filter->length;
+		filters = filter->items;
+	} else if (filter != NULL) {
+		nfilters = 1;
+		filters = &filter;
+	}
+
+	unsigned char *data = malloc(stream->stream_length + 1);
+	memcpy(data, stream->stream, stream->stream_length);
+	*length = stream->stream_length;
+
+	int i;
+	for (i = 0; i < nfilters && data != NULL; i++) {
+		struct pdf_value_t *name = pdf_resolve(file, filters[i]);
+		struct pdf_value_t *filter_parms = parms;
+		if (parms != NULL && parms->type == pdf_array) {
+			filter_parms = i < parms->length ? pdf_resolve(file, parms->items[i]) : NULL;
+		}
+
+		if (pdf_is_name(name, "FlateDecode") || pdf_is_name(name, "Fl")) {
+			size_t decoded_length;
+			unsigned char *decoded = pdf_inflate(data, *length, &decoded_length);
+			free(data);
+			data = decoded;
+			*length = decoded_length;
+			if (data != NULL && filter_parms != NULL) {
+				data = pdf_unpredict(file, filter_parms, data, length);
+			}
+		} else {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	return data;
+}
+
+// 64 bit fnv-1a, good enough to find candidates which are then compared
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+	const unsigned char *bytes = data;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
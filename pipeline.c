@@ -0,0 +1,123 @@
+#include "all.h"
+
+// method: with --pipeline, per-page crop boxes are found by a thread of its
+// own while the main thread lays out the book. The thread trims the pages in
+// the order the layout needs them, which for chapbooks alternates between
+// both ends of the document, and the layout waits for each page until it is
+// trimmed. Every page has a crop box of its own, so all crop boxes are
+// allocated before the thread starts and are not moved while it runs. If
+// trimming fails, the layout fails with the error when it waits for a page.
+
+void* pipeline_thread(void *data) {
+	struct pipeline_t *pipeline = data;
+	if (setjmp(pipeline->failure.failed) != 0) {
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->error = pipeline->failure.error;
+		pipeline->failure.error = NULL;
+		pthread_cond_broadcast(&pipeline->changed);
+		pthread_mutex_unlock(&pipeline->lock);
+		return NULL;
+	}
+	catch_failures(&pipeline->failure);
+
+	struct pages_t *pages = &pipeline->pages;
+	int num_pages_to_layout = get_num_pages_to_layout(pages->npages);
+
+	progress_start(&pages->progress, "trim", "pages", pages->npages);
+	int page_to_layout;
+	for (page_to_layout = 0; page_to_layout < num_pages_to_layout; page_to_layout++) {
+		int page_num = layout_page_num(page_to_layout, num_pages_to_layout, pipeline->options);
+		if (page_num >= pages->npages) {
+			continue;
+		}
+
+		struct page_t *page = &pages->pages[page_num];
+		*page_crop_box(pages, page) = *page_ink_extents(pages, page);
+
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->trimmed[page_num] = TRUE;
+		pipeline->done++;
+		pthread_cond_broadcast(&pipeline->changed);
+		pthread_mutex_unlock(&pipeline->lock);
+		progress_update(&pages->progress, pipeline->done);
+	}
+	progress_finish(&pages->progress);
+	return NULL;
+}
+
+// starts trimming every page to a crop box of its own on another thread
+void start_pipeline(struct pages_t *pages, struct options_t options) {
+	struct pipeline_t *pipeline = malloc(sizeof(struct pipeline_t));
+	pipeline->options = options;
+	pipeline->trimmed = calloc(pages->npages, sizeof(int));
+	pipeline->done = 0;
+	pipeline->waited = 0;
+	pipeline->failure.error = NULL;
+	pipeline->error = NULL;
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->changed, NULL);
+
+	int page_num;
+	for (page_num = 0; page_num < pages->npages; page_num++) {
+		pages->pages[page_num].crop_box = new_crop_box(pages);
+	}
+
+	// the copy shares the pages and crop boxes, which are in place now
+	pipeline->document = open_input_document(options);
+	worker_pages(&pipeline->pages, pages, pipeline->document);
+	progress_init(&pipeline->pages.progress, options.progress_fd);
+
+	pages->pipeline = pipeline;
+	if (pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline) != 0) {
+		fail("could not start a thread for trimming");
+	}
+}
+
+// waits until page has its crop box and ink extents
+void wait_for_trim(struct pages_t *pages, struct page_t *page) {
+	struct pipeline_t *pipeline = pages->pipeline;
+	if (pipeline == NULL) {
+		return;
+	}
+
+	int page_num = page - pages->pages;
+	char *error = NULL;
+	pthread_mutex_lock(&pipeline->lock);
+	if (!pipeline->trimmed[page_num]) {
+		double start = progress_now();
+		while (!pipeline->trimmed[page_num] && pipeline->error == NULL) {
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+		}
+		pipeline->waited += progress_now() - start;
+		if (!pipeline->trimmed[page_num]) {
+			error = strdup(pipeline->error);
+		}
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	raise_failure(error);
+}
+
+// waits for the last pages to be trimmed, returns the seconds the layout waited
+// fails if trimming failed
+double finish_pipeline(struct pages_t *pages) {
+	double waited = pages->pipeline->waited;
+	raise_failure(stop_pipeline(pages));
+	return waited;
+}
+
+// waits for the thread and frees the pipeline, returns the error of the
+// thread if it failed
+char* stop_pipeline(struct pages_t *pages) {
+	struct pipeline_t *pipeline = pages->pipeline;
+	pthread_join(pipeline->thread, NULL);
+	char *error = pipeline->error;
+
+	worker_pages_finish(&pipeline->pages, pages);
+	g_object_unref(pipeline->document);
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->changed);
+	free(pipeline->trimmed);
+	free(pipeline);
+	pages->pipeline = NULL;
+	return error;
+}
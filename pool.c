@@ -0,0 +1,214 @@
+#include "all.h"
+
+// page handles are loaded on first use and kept while referenced
+// unreferenced pages stay resident on an lru list until the pool is full
+
+void pool_unlink(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+
+	if (entry->prev != -1) {
+		pool->entries[entry->prev].next = entry->next;
+	} else {
+		pool->lru_head = entry->next;
+	}
+	if (entry->next != -1) {
+		pool->entries[entry->next].prev = entry->prev;
+	} else {
+		pool->lru_tail = entry->prev;
+	}
+	entry->prev = -1;
+	entry->next = -1;
+}
+
+void pool_append(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+
+	entry->prev = pool->lru_tail;
+	entry->next = -1;
+	if (pool->lru_tail != -1) {
+		pool->entries[pool->lru_tail].next = num;
+	} else {
+		pool->lru_head = num;
+	}
+	pool->lru_tail = num;
+}
+
+void pool_evict(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+
+	pool_unlink(pool, num);
+	g_object_unref(entry->page);
+	entry->page = NULL;
+	pool->resident--;
+	pool->evictions++;
+}
+
+struct page_pool_t* page_pool_new(PopplerDocument *document, int capacity) {
+	struct page_pool_t *pool = malloc(sizeof(struct page_pool_t));
+
+	pool->document = document;
+	pool->npages = poppler_document_get_n_pages(document);
+	pool->entries = malloc(sizeof(struct pool_entry_t)*pool->npages);
+	pool->capacity = capacity;
+	pool->resident = 0;
+	pool->lru_head = -1;
+	pool->lru_tail = -1;
+	pool->loads = 0;
+	pool->hits = 0;
+	pool->evictions = 0;
+	pool->keep_recordings = FALSE;
+	pool->recordings = 0;
+	pool->recording_hits = 0;
+	pool->memory = NULL;
+	pool->recording_sizes = NULL;
+
+	int num;
+	for (num = 0; num < pool->npages; num++) {
+		struct pool_entry_t *entry = &pool->entries[num];
+		entry->page = NULL;
+		entry->recording = NULL;
+		entry->refs = 0;
+		entry->prev = -1;
+		entry->next = -1;
+	}
+
+	return pool;
+}
+
+// returns a reference to page num, give it back with page_pool_put
+PopplerPage* page_pool_get(struct page_pool_t *pool, int num) {
+	if (num < 0 || num >= pool->npages) {
+		fail("ERROR: The document does not have page %d, it only has %d pages", num, pool->npages);
+	}
+
+	struct pool_entry_t *entry = &pool->entries[num];
+	if (entry->page != NULL) {
+		pool->hits++;
+		if (entry->refs == 0) {
+			pool_unlink(pool, num);
+		}
+		entry->refs++;
+		return entry->page;
+	}
+
+	// make room by dropping the least recently used idle pages
+	while (pool->resident >= pool->capacity && pool->lru_head != -1) {
+		pool_evict(pool, pool->lru_head);
+	}
+
+	entry->page = poppler_document_get_page(pool->document, num);
+	if (entry->page == NULL) {
+		fail("%s:%d: could not load page %d", __FILE__, __LINE__, num);
+	}
+	pool->loads++;
+	pool->resident++;
+	entry->refs = 1;
+
+	return entry->page;
+}
+
+void page_pool_put(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+
+	if (entry->refs <= 0) {
+		fail("%s:%d: page %d returned to the pool more often than taken", __FILE__, __LINE__, num);
+	}
+
+	entry->refs--;
+	if (entry->refs == 0) {
+		pool_append(pool, num);
+	}
+}
+
+// returns the page drawn to an unbounded recording surface
+// the recording is owned by the pool and does not hold a reference on the page
+cairo_surface_t* page_pool_get_recording(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+	if (entry->recording != NULL) {
+		pool->recording_hits++;
+		return entry->recording;
+	}
+
+	cairo_surface_t *recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
+	cairo_t *cr = cairo_create(recording);
+
+	PopplerPage *page = page_pool_get(pool, num);
+	poppler_page_render_for_printing(page, cr);
+	page_pool_put(pool, num);
+
+	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
+	cairo_destroy(cr);
+
+	entry->recording = recording;
+	pool->recordings++;
+	if (pool->recording_sizes != NULL) {
+		memory_add(pool->memory, pool->recording_sizes[num]);
+	}
+	return recording;
+}
+
+// returns the recording of page num if the pool keeps one, NULL otherwise
+cairo_surface_t* page_pool_find_recording(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+	if (entry->recording != NULL) {
+		pool->recording_hits++;
+	}
+	return entry->recording;
+}
+
+// gives the pool a recording of page num made before, e.g. in a previous run
+// the pool takes over the reference
+void page_pool_set_recording(struct page_pool_t *pool, int num, cairo_surface_t *recording) {
+	page_pool_drop_recording(pool, num);
+	pool->entries[num].recording = recording;
+	if (pool->recording_sizes != NULL) {
+		memory_add(pool->memory, pool->recording_sizes[num]);
+	}
+}
+
+void page_pool_drop_recording(struct page_pool_t *pool, int num) {
+	struct pool_entry_t *entry = &pool->entries[num];
+	if (entry->recording == NULL) {
+		return;
+	}
+
+	cairo_surface_destroy(entry->recording);
+	entry->recording = NULL;
+	if (pool->recording_sizes != NULL) {
+		memory_release(pool->memory, pool->recording_sizes[num]);
+	}
+}
+
+// returns TRUE if the recording of page num made while trimming is kept for
+// the layout, which it is not once the memory budget is used up
+int page_pool_keep_recording(struct page_pool_t *pool, int num) {
+	if (!pool->keep_recordings) {
+		return FALSE;
+	}
+	if (pool->recording_sizes != NULL && memory_available(pool->memory) == 0) {
+		pool->memory->dropped_recordings++;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void page_pool_free(struct page_pool_t *pool) {
+	int num;
+	for (num = 0; num < pool->npages; num++) {
+		struct pool_entry_t *entry = &pool->entries[num];
+		if (entry->page != NULL) {
+			g_object_unref(entry->page);
+		}
+		page_pool_drop_recording(pool, num);
+	}
+
+	free(pool->entries);
+	free(pool);
+}
+
+void print_page_pool_stats(struct page_pool_t *pool) {
+	message("Page loads: %d (%d uses of a loaded page, %d evicted)\n", pool->loads, pool->hits, pool->evictions);
+	if (pool->keep_recordings) {
+		message("Page recordings: %d (%d reused)\n", pool->recordings, pool->recording_hits);
+	}
+}
@@ -0,0 +1,95 @@
+#include "all.h"
+
+// minimum time between two progress reports, in seconds
+#define PROGRESS_INTERVAL 0.25
+
+double progress_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// peak resident set size in kilobytes
+long progress_peak_rss_kb() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024; // bytes on darwin
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+// current resident set size in kilobytes
+// falls back to the peak resident set size where /proc is not available
+long progress_rss_kb() {
+	long rss_pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		int found = fscanf(statm, "%*d %ld", &rss_pages);
+		fclose(statm);
+		if (found == 1) {
+			return rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+		}
+	}
+
+	return progress_peak_rss_kb();
+}
+
+void progress_init(struct progress_t *progress, int fd) {
+	progress->fd = fd;
+	progress->stage = NULL;
+	progress->unit = NULL;
+	progress->total = 0;
+	progress->start = 0;
+	progress->last_report = 0;
+}
+
+void progress_report(struct progress_t *progress, int done, double now) {
+	double elapsed = now - progress->start;
+	double rate = 0;
+	if (elapsed > 0) {
+		rate = done / elapsed;
+	}
+	double eta = 0;
+	if (rate > 0) {
+		eta = (progress->total - done) / rate;
+	}
+
+	dprintf(progress->fd, "{\"stage\":\"%s\",\"unit\":\"%s\",\"done\":%d,\"total\":%d,\"elapsed\":%.3f,\"rate\":%.3f,\"eta\":%.3f,\"rss_kb\":%ld}\n",
+		progress->stage, progress->unit, done, progress->total, elapsed, rate, eta, progress_rss_kb());
+	progress->last_report = now;
+}
+
+void progress_start(struct progress_t *progress, const char *stage, const char *unit, int total) {
+	if (progress->fd < 0) {
+		return;
+	}
+
+	progress->stage = stage;
+	progress->unit = unit;
+	progress->total = total;
+	progress->start = progress_now();
+	progress_report(progress, 0, progress->start);
+}
+
+// called once per unit of work, only reports every PROGRESS_INTERVAL seconds
+void progress_update(struct progress_t *progress, int done) {
+	if (progress->fd < 0) {
+		return;
+	}
+
+	double now = progress_now();
+	if (now - progress->last_report < PROGRESS_INTERVAL) {
+		return;
+	}
+	progress_report(progress, done, now);
+}
+
+void progress_finish(struct progress_t *progress) {
+	if (progress->fd < 0) {
+		return;
+	}
+
+	progress_report(progress, progress->total, progress_now());
+}
@@ -0,0 +1,307 @@
+#include "all.h"
+
+// method: tasks are sorted by their estimated cost and dealt out, most
+// expensive first, to the worker whose queue has the least cost so far. Every
+// worker takes tasks from the front of its own queue, so the expensive tasks
+// start first, and once its queue is empty takes the cheapest task from the
+// back of the queue with the most cost left. A few expensive tasks started
+// late can then not keep one worker busy while the others wait. Without
+// stealing, which worker runs a task only depends on the costs.
+// The threads are started once with the scheduler and wait for every run.
+// A run can be started and waited for later, so the calling thread can do
+// other work meanwhile. A task that fails ends the run: no more tasks are
+// started and the error is raised by scheduler_wait on the calling thread.
+
+struct deque_t {
+	pthread_mutex_t lock;
+	int *tasks; // indexes into the tasks of the run, most expensive first
+	int head, tail; // tasks[head, tail) are left
+	double cost; // of the tasks left
+};
+
+struct scheduler_thread_t {
+	struct scheduler_t *scheduler;
+	int worker;
+};
+
+struct scheduler_t* scheduler_new(int nworkers, void **contexts) {
+	struct scheduler_t *scheduler = malloc(sizeof(struct scheduler_t));
+	scheduler->nworkers = nworkers;
+	scheduler->contexts = contexts;
+	scheduler->deques = calloc(nworkers, sizeof(struct deque_t));
+	scheduler->stats = calloc(nworkers, sizeof(struct worker_stats_t));
+	scheduler->wall = 0;
+	scheduler->steal = TRUE;
+	scheduler->run_task = NULL;
+	scheduler->tasks = NULL;
+	scheduler->costs = NULL;
+	scheduler->runs = 0;
+	scheduler->running = 0;
+	scheduler->run_start = 0;
+	scheduler->stopping = FALSE;
+	scheduler->error = NULL;
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->started, NULL);
+	pthread_cond_init(&scheduler->finished, NULL);
+
+	int worker;
+	for (worker = 0; worker < nworkers; worker++) {
+		pthread_mutex_init(&scheduler->deques[worker].lock, NULL);
+	}
+
+	scheduler->threads = malloc(sizeof(pthread_t)*nworkers);
+	scheduler->thread_data = malloc(sizeof(struct scheduler_thread_t)*nworkers);
+	scheduler->failures = calloc(nworkers, sizeof(struct failure_t));
+	for (worker = 0; worker < nworkers; worker++) {
+		scheduler->thread_data[worker].scheduler = scheduler;
+		scheduler->thread_data[worker].worker = worker;
+		if (pthread_create(&scheduler->threads[worker], NULL, scheduler_thread, &scheduler->thread_data[worker]) != 0) {
+			fail("could not start a thread");
+		}
+	}
+	return scheduler;
+}
+
+void scheduler_free(struct scheduler_t *scheduler) {
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stopping = TRUE;
+	pthread_cond_broadcast(&scheduler->started);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	int worker;
+	for (worker = 0; worker < scheduler->nworkers; worker++) {
+		pthread_join(scheduler->threads[worker], NULL);
+	}
+	for (worker = 0; worker < scheduler->nworkers; worker++) {
+		pthread_mutex_destroy(&scheduler->deques[worker].lock);
+		free(scheduler->deques[worker].tasks);
+	}
+	pthread_cond_destroy(&scheduler->finished);
+	pthread_cond_destroy(&scheduler->started);
+	pthread_mutex_destroy(&scheduler->lock);
+	free(scheduler->failures);
+	free(scheduler->thread_data);
+	free(scheduler->threads);
+	free(scheduler->deques);
+	free(scheduler->stats);
+	free(scheduler);
+}
+
+// returns FALSE if the deque is empty
+int deque_take(struct deque_t *deque, double *costs, int from_back, int *task) {
+	int taken = FALSE;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head < deque->tail) {
+		if (from_back) {
+			*task = deque->tasks[--deque->tail];
+		} else {
+			*task = deque->tasks[deque->head++];
+		}
+		deque->cost -= costs[*task];
+		taken = TRUE;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return taken;
+}
+
+// takes a task from the queue of another worker with the most cost left
+int scheduler_steal(struct scheduler_t *scheduler, double *costs, int thief, int *task) {
+	for (;;) {
+		int victim = -1;
+		double most = 0;
+		int worker;
+		for (worker = 0; worker < scheduler->nworkers; worker++) {
+			struct deque_t *deque = &scheduler->deques[worker];
+			pthread_mutex_lock(&deque->lock);
+			if (worker != thief && deque->head < deque->tail && (victim == -1 || deque->cost > most)) {
+				victim = worker;
+				most = deque->cost;
+			}
+			pthread_mutex_unlock(&deque->lock);
+		}
+		if (victim == -1) {
+			return FALSE;
+		}
+		// the victim may have taken its last task in the meantime
+		if (deque_take(&scheduler->deques[victim], costs, TRUE, task)) {
+			return TRUE;
+		}
+	}
+}
+
+// runs the tasks of the current run until there are none left to take
+// stops early if a task failed or the scheduler is freed
+void scheduler_work(struct scheduler_t *scheduler, int worker) {
+	struct worker_stats_t *stats = &scheduler->stats[worker];
+
+	for (;;) {
+		pthread_mutex_lock(&scheduler->lock);
+		int stop = scheduler->error != NULL || scheduler->stopping;
+		pthread_mutex_unlock(&scheduler->lock);
+		if (stop) {
+			break;
+		}
+
+		int task;
+		if (!deque_take(&scheduler->deques[worker], scheduler->costs, FALSE, &task)) {
+			if (!scheduler->steal || !scheduler_steal(scheduler, scheduler->costs, worker, &task)) {
+				break;
+			}
+			stats->stolen++;
+		}
+
+		double start = progress_now();
+		scheduler->run_task(scheduler->contexts[worker], scheduler->tasks[task]);
+		stats->busy += progress_now() - start;
+		stats->tasks++;
+	}
+}
+
+// waits for a run, works on it and waits for the next one
+void* scheduler_thread(void *data) {
+	struct scheduler_thread_t *thread = data;
+	struct scheduler_t *scheduler = thread->scheduler;
+	struct failure_t *failure = &scheduler->failures[thread->worker];
+	int runs = 0;
+	catch_failures(failure);
+
+	pthread_mutex_lock(&scheduler->lock);
+	for (;;) {
+		while (scheduler->runs == runs && !scheduler->stopping) {
+			pthread_cond_wait(&scheduler->started, &scheduler->lock);
+		}
+		if (scheduler->stopping) {
+			break;
+		}
+		runs = scheduler->runs;
+		pthread_mutex_unlock(&scheduler->lock);
+
+		if (setjmp(failure->failed) == 0) {
+			scheduler_work(scheduler, thread->worker);
+		}
+
+		pthread_mutex_lock(&scheduler->lock);
+		// the first error fails the run
+		if (failure->error != NULL && scheduler->error == NULL) {
+			scheduler->error = failure->error;
+		} else {
+			free(failure->error);
+		}
+		failure->error = NULL;
+		scheduler->running--;
+		if (scheduler->running == 0) {
+			pthread_cond_signal(&scheduler->finished);
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+	return NULL;
+}
+
+struct sort_task_t {
+	int index;
+	double cost;
+};
+
+// most expensive first, tasks of the same cost in their order
+int compare_costs(const void *a, const void *b) {
+	const struct sort_task_t *task_a = a;
+	const struct sort_task_t *task_b = b;
+	if (task_a->cost != task_b->cost) {
+		return task_a->cost < task_b->cost ? 1 : -1;
+	}
+	return task_a->index - task_b->index;
+}
+
+// hands run_task(context of the worker, tasks[i]) for every task out to the
+// workers and returns without waiting for them. tasks and costs must be kept
+// until scheduler_wait returns, and only one run can be started at a time.
+void scheduler_start(struct scheduler_t *scheduler, void (*run_task)(void *context, int task), int *tasks, double *costs, int ntasks) {
+	scheduler->run_start = progress_now();
+	if (ntasks == 0) {
+		return;
+	}
+
+	struct sort_task_t *sorted = malloc(sizeof(struct sort_task_t)*ntasks);
+	int i;
+	for (i = 0; i < ntasks; i++) {
+		sorted[i].index = i;
+		sorted[i].cost = costs[i];
+	}
+	qsort(sorted, ntasks, sizeof(struct sort_task_t), compare_costs);
+
+	int worker;
+	for (worker = 0; worker < scheduler->nworkers; worker++) {
+		struct deque_t *deque = &scheduler->deques[worker];
+		deque->tasks = realloc(deque->tasks, sizeof(int)*ntasks);
+		deque->head = 0;
+		deque->tail = 0;
+		deque->cost = 0;
+	}
+	for (i = 0; i < ntasks; i++) {
+		struct deque_t *least = &scheduler->deques[0];
+		for (worker = 1; worker < scheduler->nworkers; worker++) {
+			if (scheduler->deques[worker].cost < least->cost) {
+				least = &scheduler->deques[worker];
+			}
+		}
+		least->tasks[least->tail++] = sorted[i].index;
+		least->cost += sorted[i].cost;
+	}
+	free(sorted);
+
+	// the deques are filled before the lock hands the run to the threads
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->run_task = run_task;
+	scheduler->tasks = tasks;
+	scheduler->costs = costs;
+	scheduler->running = scheduler->nworkers;
+	scheduler->runs++;
+	pthread_cond_broadcast(&scheduler->started);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+// returns once all tasks of the run started last are done, fails if one of
+// them failed
+void scheduler_wait(struct scheduler_t *scheduler) {
+	pthread_mutex_lock(&scheduler->lock);
+	while (scheduler->running > 0) {
+		pthread_cond_wait(&scheduler->finished, &scheduler->lock);
+	}
+	char *error = scheduler->error;
+	scheduler->error = NULL;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	scheduler->wall += progress_now() - scheduler->run_start;
+	raise_failure(error);
+}
+
+// runs run_task(context of the worker, tasks[i]) for every task on the
+// workers and returns once all are done, fails if one of them failed
+void scheduler_run(struct scheduler_t *scheduler, void (*run_task)(void *context, int task), int *tasks, double *costs, int ntasks) {
+	scheduler_start(scheduler, run_task, tasks, costs, ntasks);
+	scheduler_wait(scheduler);
+}
+
+// prints how much of the time spent running tasks each worker was busy
+void print_scheduler_stats(struct scheduler_t *scheduler, char *stage) {
+	double busy = 0;
+	int worker;
+	for (worker = 0; worker < scheduler->nworkers; worker++) {
+		busy += scheduler->stats[worker].busy;
+	}
+	double available = scheduler->wall * scheduler->nworkers;
+	message("%s on %d threads: %.0f%% busy\n", stage, scheduler->nworkers,
+		available > 0 ? 100 * busy / available : 100);
+
+	for (worker = 0; worker < scheduler->nworkers; worker++) {
+		struct worker_stats_t *stats = &scheduler->stats[worker];
+		message("  thread %d: %d pages (%d stolen), %.0f%% busy\n", worker + 1, stats->tasks, stats->stolen,
+			scheduler->wall > 0 ? 100 * stats->busy / scheduler->wall : 100);
+	}
+}
+
+// forgets the stats, so the next stage is reported on its own
+void reset_scheduler_stats(struct scheduler_t *scheduler) {
+	memset(scheduler->stats, 0, sizeof(struct worker_stats_t)*scheduler->nworkers);
+	scheduler->wall = 0;
+}
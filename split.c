@@ -0,0 +1,257 @@
+#include "all.h"
+
+// method: the sheets are split into parts of options.split sheets and every
+// part is written to its own pdf by one of a few worker threads. Workers take
+// the parts in print order, so the first parts are finished first. Each
+// worker opens the input again, because poppler documents and the page pool
+// must not be shared between threads; the crop boxes found by the trim pass
+// are shared and only read. A part is written under a temporary name and
+// renamed when it is complete, so a part that exists can be printed. A
+// worker that fails removes the part it was writing and stops the others
+// from taking more parts, and the error is raised once all of them are
+// joined. The manifest is only written once every part is.
+
+struct split_t {
+	struct pages_t *pages; // trimmed by the main thread
+	struct options_t options;
+	int nsheets;
+	int nparts;
+	char **filenames; // of the parts, in print order
+	pthread_mutex_t lock; // protects everything below
+	int next_part;
+	int sheets_done;
+	struct dedup_stats_t dedup;
+	char *error; // of the first worker that failed
+};
+
+// a thread writing parts, cleaned up by split_book once it was joined
+struct split_worker_t {
+	struct split_t *split;
+	pthread_t thread;
+	PopplerDocument *document; // NULL until opened
+	char *temporary_filename; // of the part being written, NULL between parts
+	struct pages_t pages; // a copy with a page pool and input of its own
+	int has_pages;
+	struct failure_t failure;
+};
+
+char* split_base_name(char *output_filename) {
+	char *base = strdup(output_filename);
+	char *extension = rindex(base, '.');
+	if (extension != NULL && strcasecmp(extension, ".pdf") == 0) {
+		*extension = 0;
+	}
+	return base;
+}
+
+// names of the parts are numbered with as many digits as the last part needs
+char** split_filenames(char *output_filename, int nparts) {
+	char *base = split_base_name(output_filename);
+	int digits = snprintf(NULL, 0, "%d", nparts);
+
+	char **filenames = malloc(sizeof(char*)*nparts);
+	int part;
+	for (part = 0; part < nparts; part++) {
+		asprintf(&filenames[part], "%s.part%0*d.pdf", base, digits, part + 1);
+	}
+
+	free(base);
+	return filenames;
+}
+
+// lists the file names of the parts in print order, one per line, without
+// directories so the manifest can be moved together with the parts
+char* write_manifest(char *output_filename, char **filenames, int nparts) {
+	char *base = split_base_name(output_filename);
+	char *manifest_filename;
+	asprintf(&manifest_filename, "%s.manifest", base);
+	free(base);
+
+	char *temporary_filename;
+	asprintf(&temporary_filename, "%s.tmp", manifest_filename);
+	FILE *manifest = fopen(temporary_filename, "w");
+	if (manifest == NULL) {
+		fail("could not write %s: %s", temporary_filename, strerror(errno));
+	}
+
+	int part;
+	for (part = 0; part < nparts; part++) {
+		char *name = rindex(filenames[part], '/');
+		fprintf(manifest, "%s\n", name != NULL ? name + 1 : filenames[part]);
+	}
+
+	if (fclose(manifest) != 0 || rename(temporary_filename, manifest_filename) == -1) {
+		fail("could not write %s: %s", manifest_filename, strerror(errno));
+	}
+	free(temporary_filename);
+	return manifest_filename;
+}
+
+void write_part(struct split_worker_t *worker, int part) {
+	struct split_t *split = worker->split;
+	struct pages_t *pages = &worker->pages;
+	PopplerDocument *document = worker->document;
+	struct options_t options = split->options;
+
+	char *temporary_filename;
+	asprintf(&temporary_filename, "%s.tmp", split->filenames[part]);
+	worker->temporary_filename = temporary_filename;
+
+	cairo_surface_t *surface = cairo_pdf_surface_create(temporary_filename, options.paper_width, options.paper_height);
+	if (options.dedup) {
+		// keep every object at the top level so the file can be rewritten
+		cairo_pdf_surface_restrict_to_version(surface, CAIRO_PDF_VERSION_1_4);
+	}
+	if (options.deterministic) {
+		set_deterministic_metadata(surface);
+	}
+	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
+	cairo_t *cr = cairo_create(surface);
+	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
+
+	// the parts put together are the same as the book in one file
+	if (part == 0 && options.add_cover) {
+		add_cover(document, surface, cr, pages, options);
+	}
+
+	int first_sheet = part * options.split;
+	int nsheets = options.split;
+	if (first_sheet + nsheets > split->nsheets) {
+		nsheets = split->nsheets - first_sheet;
+	}
+	layout_sheets(surface, cr, pages, options, first_sheet, nsheets);
+
+	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
+	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
+	exit_if_cairo_surface_status_not_success(surface, __FILE__, __LINE__);
+
+	struct dedup_stats_t stats = {0, 0};
+	if (options.dedup) {
+		char *error = dedup_file(temporary_filename, &stats);
+		if (error != NULL) {
+			// the part is complete, only larger than it could be
+			message("Could not deduplicate part %d, it is kept as it was: %s\n", part + 1, error);
+			free(error);
+		}
+	}
+
+	if (rename(temporary_filename, split->filenames[part]) == -1) {
+		fail("could not write %s: %s", split->filenames[part], strerror(errno));
+	}
+	worker->temporary_filename = NULL;
+	free(temporary_filename);
+
+	pthread_mutex_lock(&split->lock);
+	split->sheets_done += nsheets;
+	split->dedup.objects += stats.objects;
+	split->dedup.bytes += stats.bytes;
+	progress_update(&split->pages->progress, split->sheets_done);
+	pthread_mutex_unlock(&split->lock);
+}
+
+void* split_worker(void *data) {
+	struct split_worker_t *worker = data;
+	struct split_t *split = worker->split;
+	if (setjmp(worker->failure.failed) != 0) {
+		if (worker->temporary_filename != NULL) {
+			unlink(worker->temporary_filename);
+			free(worker->temporary_filename);
+			worker->temporary_filename = NULL;
+		}
+		pthread_mutex_lock(&split->lock);
+		if (split->error == NULL) {
+			split->error = worker->failure.error;
+			worker->failure.error = NULL;
+		}
+		pthread_mutex_unlock(&split->lock);
+		return NULL;
+	}
+	catch_failures(&worker->failure);
+
+	worker->document = open_input_document(split->options);
+	worker_pages(&worker->pages, split->pages, worker->document);
+	worker->has_pages = TRUE;
+	worker->pages.pool->keep_recordings = split->options.engine == xobject;
+
+	for (;;) {
+		pthread_mutex_lock(&split->lock);
+		int part = split->error == NULL ? split->next_part++ : split->nparts;
+		pthread_mutex_unlock(&split->lock);
+		if (part >= split->nparts) {
+			break;
+		}
+		write_part(worker, part);
+	}
+	return NULL;
+}
+
+// writes the book as parts of options.split sheets and a manifest
+// returns the file name of the manifest
+char* split_book(struct pages_t *pages, struct options_t options, struct dedup_stats_t *dedup) {
+	struct split_t split;
+	split.pages = pages;
+	split.options = options;
+	split.nsheets = get_num_pages_to_layout(pages->npages)/4;
+	split.nparts = (split.nsheets + options.split - 1) / options.split;
+	split.filenames = split_filenames(options.output_filename, split.nparts);
+	pthread_mutex_init(&split.lock, NULL);
+	split.next_part = 0;
+	split.sheets_done = 0;
+	split.dedup.objects = 0;
+	split.dedup.bytes = 0;
+	split.error = NULL;
+
+	int nthreads = options.threads;
+	if (nthreads > split.nparts) {
+		nthreads = split.nparts;
+	}
+	nthreads = memory_threads(pages->memory, pages->largest_recording + document_memory(pages), nthreads);
+
+	progress_start(&pages->progress, "layout", "sheets", split.nsheets);
+
+	struct split_worker_t *workers = calloc(nthreads, sizeof(struct split_worker_t));
+	int started;
+	for (started = 0; started < nthreads; started++) {
+		workers[started].split = &split;
+		if (pthread_create(&workers[started].thread, NULL, split_worker, &workers[started]) != 0) {
+			break;
+		}
+	}
+	// the threads that did start write all parts
+	if (started == 0) {
+		fail("could not start a thread for writing parts");
+	}
+	int thread;
+	for (thread = 0; thread < started; thread++) {
+		struct split_worker_t *worker = &workers[thread];
+		pthread_join(worker->thread, NULL);
+		if (worker->has_pages) {
+			worker_pages_finish(&worker->pages, pages);
+		}
+		if (worker->document != NULL) {
+			g_object_unref(worker->document);
+		}
+		free(worker->failure.error);
+	}
+	free(workers);
+
+	progress_finish(&pages->progress);
+
+	*dedup = split.dedup;
+
+	pthread_mutex_destroy(&split.lock);
+	char *manifest_filename = NULL;
+	if (split.error == NULL) {
+		manifest_filename = write_manifest(options.output_filename, split.filenames, split.nparts);
+	}
+	int part;
+	for (part = 0; part < split.nparts; part++) {
+		free(split.filenames[part]);
+	}
+	free(split.filenames);
+	if (split.error != NULL) {
+		raise_failure(split.error);
+	}
+	return manifest_filename;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <cairo.h>
+#include <cairo-pdf.h>
+
+// method: writes a small document for make check with cairo. Its pages have
+// what the fast paths of bookmaker treat differently: text with margins that
+// differ between even and odd pages, the same image on many pages, lines and
+// shapes without text, pages that are only an image, and blank pages.
+
+#define PAGE_WIDTH 432 // 6x9in
+#define PAGE_HEIGHT 648
+
+void draw_text_page(cairo_t *cr, int page_num) {
+	// odd pages are bound on the left, even pages on the right
+	double left = page_num % 2 == 0 ? 72 : 54;
+
+	cairo_select_font_face(cr, "serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+	cairo_set_font_size(cr, 11);
+	cairo_set_source_rgb(cr, 0, 0, 0);
+
+	// later pages have fewer lines, so the crop boxes differ per page
+	int nlines = 30 - page_num % 7;
+	int line;
+	for (line = 0; line < nlines; line++) {
+		char text[128];
+		snprintf(text, sizeof(text), "Page %d, line %d: the quick brown fox jumps over the lazy dog", page_num + 1, line + 1);
+		cairo_move_to(cr, left, 90 + line * 16);
+		cairo_show_text(cr, text);
+	}
+}
+
+cairo_surface_t* create_pattern_image(int width, int height) {
+	cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	cairo_t *cr = cairo_create(image);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+
+	int x, y;
+	for (y = 0; y < height; y += 8) {
+		for (x = (y / 8) % 2 * 8; x < width; x += 16) {
+			cairo_set_source_rgb(cr, (double) x / width, 0.3, (double) y / height);
+			cairo_rectangle(cr, x, y, 8, 8);
+			cairo_fill(cr);
+		}
+	}
+	cairo_destroy(cr);
+	return image;
+}
+
+// a logo in the corner, the same image on every page using it
+void draw_logo(cairo_t *cr, cairo_surface_t *logo) {
+	cairo_save(cr);
+	cairo_translate(cr, PAGE_WIDTH - 126, 40);
+	cairo_set_source_surface(cr, logo, 0, 0);
+	cairo_paint(cr);
+	cairo_restore(cr);
+}
+
+void draw_shapes_page(cairo_t *cr) {
+	cairo_set_source_rgb(cr, 0.1, 0.1, 0.6);
+	cairo_set_line_width(cr, 2);
+	cairo_rectangle(cr, 80, 120, 260, 180);
+	cairo_stroke(cr);
+	cairo_arc(cr, 216, 420, 90, 0, 2 * M_PI);
+	cairo_fill(cr);
+	cairo_move_to(cr, 60, 580);
+	cairo_line_to(cr, 370, 560);
+	cairo_stroke(cr);
+}
+
+// like a scanned page, nothing but an image covering the page
+void draw_scan_page(cairo_t *cr, cairo_surface_t *scan) {
+	cairo_save(cr);
+	cairo_scale(cr, (double) PAGE_WIDTH / cairo_image_surface_get_width(scan),
+		(double) PAGE_HEIGHT / cairo_image_surface_get_height(scan));
+	cairo_set_source_surface(cr, scan, 0, 0);
+	cairo_paint(cr);
+	cairo_restore(cr);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 3) {
+		printf("usage: %s OUTPUT.pdf [PAGES]\n", argv[0]);
+		return 1;
+	}
+	int npages = argc == 3 ? atoi(argv[2]) : 13;
+
+	cairo_surface_t *surface = cairo_pdf_surface_create(argv[1], PAGE_WIDTH, PAGE_HEIGHT);
+	cairo_t *cr = cairo_create(surface);
+	cairo_surface_t *logo = create_pattern_image(86, 48);
+	cairo_surface_t *scan = create_pattern_image(360, 540);
+
+	int page_num;
+	for (page_num = 0; page_num < npages; page_num++) {
+		switch (page_num % 8) {
+		case 3:
+			draw_shapes_page(cr);
+			break;
+		case 5:
+			draw_scan_page(cr, scan);
+			break;
+		case 6:
+			// blank
+			break;
+		default:
+			draw_text_page(cr, page_num);
+			if (page_num % 2 == 0) {
+				draw_logo(cr, logo);
+			}
+		}
+		cairo_show_page(cr);
+	}
+
+	cairo_surface_destroy(scan);
+	cairo_surface_destroy(logo);
+	cairo_destroy(cr);
+	cairo_surface_finish(surface);
+	cairo_status_t status = cairo_surface_status(surface);
+	cairo_surface_destroy(surface);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		printf("%s: %s\n", argv[1], cairo_status_to_string(status));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include "all.h"
+
+// method: --verify makes the book a second time, in memory, the way bookmaker
+// makes it without any of the fast paths: on one thread, drawing every page
+// to trim it, drawing every page again with poppler, and without passing
+// images through, keeping drawings, reusing trims or deduplicating. The crop
+// boxes of both are compared page by page, and every output page of both is
+// rasterized at low resolution and compared pixel by pixel.
+
+#define VERIFY_DPI 36
+#define VERIFY_CROP_TOLERANCE 0.5 // points
+#define VERIFY_PIXEL_DIFFERENCE 64 // of a color channel, for a pixel to differ
+#define VERIFY_PIXEL_TOLERANCE 0.001 // of the pixels of a page that may differ
+
+struct options_t reference_options(struct options_t options) {
+	options.engine = render;
+	options.fast_trim = FALSE;
+	options.trim_sample = 0;
+	options.passthrough = FALSE;
+	options.dedup = FALSE;
+	options.threads = 1;
+	options.max_memory = 0;
+	options.write_buffers = 0;
+	options.watch = FALSE;
+	options.pipeline = FALSE;
+	// verify stays set so the reference keeps its crop boxes
+	options.progress_fd = -1;
+	return options;
+}
+
+int write_to_buffer(void *closure, const unsigned char *data, unsigned int length) {
+	buffer_append(closure, data, length);
+	return 0;
+}
+
+cairo_surface_t* rasterize_page(PopplerDocument *document, int num) {
+	PopplerPage *page = poppler_document_get_page(document, num);
+	double width, height;
+	poppler_page_get_size(page, &width, &height);
+
+	double scale = VERIFY_DPI / 72.0;
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, ceil(width * scale), ceil(height * scale));
+	cairo_t *cr = cairo_create(surface);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	cairo_scale(cr, scale, scale);
+	poppler_page_render_for_printing(page, cr);
+	exit_if_cairo_status_not_success(cr, __FILE__, __LINE__);
+	cairo_destroy(cr);
+	g_object_unref(page);
+
+	cairo_surface_flush(surface);
+	return surface;
+}
+
+// returns the share of the pixels that differ, 1 if the sizes differ
+double compare_pages(cairo_surface_t *a, cairo_surface_t *b) {
+	int width = cairo_image_surface_get_width(a);
+	int height = cairo_image_surface_get_height(a);
+	if (width != cairo_image_surface_get_width(b) || height != cairo_image_surface_get_height(b)) {
+		return 1;
+	}
+
+	int differing = 0;
+	int y;
+	for (y = 0; y < height; y++) {
+		uint32_t *row_a = (uint32_t*) (cairo_image_surface_get_data(a) + y * cairo_image_surface_get_stride(a));
+		uint32_t *row_b = (uint32_t*) (cairo_image_surface_get_data(b) + y * cairo_image_surface_get_stride(b));
+		int x;
+		for (x = 0; x < width; x++) {
+			int shift;
+			for (shift = 0; shift < 24; shift += 8) {
+				int channel_a = (row_a[x] >> shift) & 0xff;
+				int channel_b = (row_b[x] >> shift) & 0xff;
+				if (abs(channel_a - channel_b) > VERIFY_PIXEL_DIFFERENCE) {
+					differing++;
+					break;
+				}
+			}
+		}
+	}
+	return width * height > 0 ? (double) differing / (width * height) : 0;
+}
+
+// compares the book job wrote to its output file with the reference book
+// returns FALSE if they differ
+int verify_book(struct bookmaker_t *job) {
+	struct options_t options = job->options;
+	double start = stage_start("Verifying");
+
+	// the reference is made quietly and its errors are returned
+	struct bookmaker_t *reference = bookmaker_new_with_options(reference_options(options));
+	reference->library = TRUE;
+	struct buffer_t book = {NULL, 0, 0};
+	if (!bookmaker_open_file(reference, options.input_filename) || !bookmaker_run(reference, write_to_buffer, &book)) {
+		message("\nCould not make the reference book: %s\n", bookmaker_error(reference));
+		bookmaker_free(reference);
+		free(book.data);
+		return FALSE;
+	}
+
+	int ok = TRUE;
+	int npages = poppler_document_get_n_pages(job->document);
+	double largest_crop_difference = 0;
+	int page_num;
+	for (page_num = 0; page_num < npages && job->crop_boxes != NULL; page_num++) {
+		cairo_rectangle_t *a = &job->crop_boxes[page_num];
+		cairo_rectangle_t *b = &reference->crop_boxes[page_num];
+		double difference = fmax(fmax(fabs(a->x - b->x), fabs(a->y - b->y)),
+			fmax(fabs(a->width - b->width), fabs(a->height - b->height)));
+		largest_crop_difference = fmax(largest_crop_difference, difference);
+		if (difference > VERIFY_CROP_TOLERANCE) {
+			message("\n  crop box of page %d differs by %.2fpt", page_num + 1, difference);
+			ok = FALSE;
+		}
+	}
+
+	PopplerDocument *output = open_document(options.output_filename);
+	PopplerDocument *expected = poppler_document_new_from_data(book.data, book.length, NULL, NULL);
+	if (expected == NULL) {
+		fail("Could not open the reference book");
+	}
+	int nsheets = poppler_document_get_n_pages(output);
+	int differing_sheets = 0;
+	if (nsheets != poppler_document_get_n_pages(expected)) {
+		message("\n  %d output pages instead of %d", nsheets, poppler_document_get_n_pages(expected));
+		ok = FALSE;
+	} else {
+		int num;
+		for (num = 0; num < nsheets; num++) {
+			cairo_surface_t *a = rasterize_page(output, num);
+			cairo_surface_t *b = rasterize_page(expected, num);
+			double difference = compare_pages(a, b);
+			cairo_surface_destroy(a);
+			cairo_surface_destroy(b);
+			if (difference > VERIFY_PIXEL_TOLERANCE) {
+				message("\n  output page %d differs in %.2f%% of its pixels", num + 1, 100 * difference);
+				differing_sheets++;
+				ok = FALSE;
+			}
+		}
+	}
+	g_object_unref(expected);
+	g_object_unref(output);
+	bookmaker_free(reference);
+	free(book.data);
+
+	double seconds;
+	stage_finish(start, &seconds);
+	message("Compared %d crop boxes (within %.2fpt) and %d output pages (%d differ) with the reference: %s\n",
+		npages, largest_crop_difference, nsheets, differing_sheets, ok ? "same" : "DIFFERENT");
+	return ok;
+}
@@ -0,0 +1,316 @@
+#include "all.h"
+
+// method: --watch makes the book again every time the input is rewritten,
+// in the same process. The ink extents found while trimming, and the
+// recordings the xobject engine keeps from trimming for the layout, are kept
+// between runs by a hash of everything that can change how a page is drawn:
+// its content streams, resources, boxes and annotations. Pages with the same
+// hash as a page of the previous run are not drawn to trim them again, and
+// if their recording was kept they are not drawn to lay them out either, so
+// only the pages that changed are drawn. The input is watched with inotify
+// where available and by polling its modification time elsewhere.
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <libgen.h>
+#endif
+
+#define HASH_DEPTH 16 // of nested objects, resources do not go deeper
+#define WATCH_QUIET 250 // milliseconds without changes before the input is read
+
+// indirect objects are hashed once and remembered in memo, so resources
+// shared by many pages are not hashed again for every page. An object first
+// reached deep down was cut off early and is hashed again when it is reached
+// with more depth left.
+uint64_t hash_value(struct pdf_file_t *pdf, struct hash_memo_t *memo, uint64_t hash, struct pdf_value_t *value, int depth) {
+	if (value != NULL && value->type == pdf_ref && value->num > 0 && value->num < memo->size && depth > 0) {
+		uint64_t *object_hash = &memo->hashes[value->num];
+		// objects that refer back to themselves see 1 while being hashed
+		if (*object_hash == 0 || (*object_hash != 1 && memo->depths[value->num] < depth)) {
+			*object_hash = 1;
+			uint64_t computed = hash_value(pdf, memo, HASH_SEED, pdf_resolve(pdf, value), depth - 1);
+			*object_hash = computed > 1 ? computed : 2;
+			memo->depths[value->num] = depth;
+		}
+		return hash_bytes(hash, object_hash, sizeof(*object_hash));
+	}
+
+	value = pdf_resolve(pdf, value);
+	if (value == NULL || depth == 0) {
+		return hash_bytes(hash, "null", 4);
+	}
+
+	hash = hash_bytes(hash, &value->type, sizeof(value->type));
+	int i;
+	switch (value->type) {
+	case pdf_bool:
+	case pdf_number:
+		hash = hash_bytes(hash, &value->number, sizeof(value->number));
+		break;
+	case pdf_string:
+	case pdf_name:
+		hash = hash_bytes(hash, value->string, value->type == pdf_string ? value->length : strlen(value->string));
+		break;
+	case pdf_array:
+		for (i = 0; i < value->length; i++) {
+			hash = hash_value(pdf, memo, hash, value->items[i], depth - 1);
+		}
+		break;
+	case pdf_stream:
+		hash = hash_bytes(hash, value->stream, value->stream_length);
+		// NO BREAK; the dictionary of the stream is hashed as well
+	case pdf_dict:
+		for (i = 0; i < value->length; i++) {
+			// links back up the page tree are not part of the page
+			if (strcmp(value->keys[i], "Parent") == 0 || strcmp(value->keys[i], "P") == 0) {
+				continue;
+			}
+			hash = hash_bytes(hash, value->keys[i], strlen(value->keys[i]));
+			hash = hash_value(pdf, memo, hash, value->items[i], depth - 1);
+		}
+		break;
+	default:
+		break;
+	}
+	return hash;
+}
+
+// returns a hash of what page num draws, 0 if the page can not be read
+// memo is shared by the pages of a document, see hash_value
+uint64_t page_hash(struct pdf_file_t *pdf, struct hash_memo_t *memo, int num) {
+	static const char *keys[] = {"Contents", "Resources", "MediaBox", "CropBox", "Rotate", "Annots", NULL};
+
+	struct pdf_value_t *page = pdf_page(pdf, num);
+	if (page == NULL) {
+		return 0;
+	}
+
+	uint64_t hash = HASH_SEED;
+	int i;
+	for (i = 0; keys[i] != NULL; i++) {
+		hash = hash_value(pdf, memo, hash, pdf_page_attribute(pdf, page, keys[i]), HASH_DEPTH);
+	}
+	return hash != 0 ? hash : 1;
+}
+
+struct trim_cache_t* trim_cache_new() {
+	struct trim_cache_t *cache = malloc(sizeof(struct trim_cache_t));
+	cache->entries = NULL;
+	cache->size = 0;
+	return cache;
+}
+
+void trim_cache_clear(struct trim_cache_t *cache) {
+	int i;
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].recording != NULL) {
+			cairo_surface_destroy(cache->entries[i].recording);
+		}
+	}
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->size = 0;
+}
+
+void trim_cache_free(struct trim_cache_t *cache) {
+	trim_cache_clear(cache);
+	free(cache);
+}
+
+// open addressing, size is a power of two and entries with hash 0 are empty
+struct trim_cache_entry_t* trim_cache_find(struct trim_cache_t *cache, uint64_t hash) {
+	int i = hash & (cache->size - 1);
+	while (cache->entries[i].hash != 0 && cache->entries[i].hash != hash) {
+		i = (i + 1) & (cache->size - 1);
+	}
+	return &cache->entries[i];
+}
+
+// gives the pages that were trimmed in the previous run their ink extents
+// and their recordings, where they were kept and the memory budget allows
+// returns the hashes of the pages for update_trim_cache, NULL if the pages
+// can not be hashed
+uint64_t* use_trim_cache(struct trim_cache_t *cache, struct pages_t *pages) {
+	if (pages->pdf == NULL || pdf_page_count(pages->pdf) != pages->pool->npages) {
+		return NULL;
+	}
+
+	uint64_t *hashes = malloc(sizeof(uint64_t)*pages->pool->npages);
+	struct hash_memo_t memo = {calloc(pages->pdf->nobjects, sizeof(uint64_t)), calloc(pages->pdf->nobjects, sizeof(int)),
+		pages->pdf->nobjects};
+	int reused = 0;
+	int redrawn = 0;
+	int page_num;
+	for (page_num = 0; page_num < pages->npages; page_num++) {
+		struct page_t *page = &pages->pages[page_num];
+		hashes[page->num] = page_hash(pages->pdf, &memo, page->num);
+		if (cache->size == 0 || hashes[page->num] == 0) {
+			continue;
+		}
+
+		struct trim_cache_entry_t *entry = trim_cache_find(cache, hashes[page->num]);
+		if (entry->hash == 0) {
+			continue;
+		}
+		page->ink_extents = entry->ink_extents;
+		page->has_ink_extents = TRUE;
+		reused++;
+
+		// pages drawn ahead by threads are taken from the recordings of the workers
+		if (entry->recording != NULL && page_pool_keep_recording(pages->pool, page->num)) {
+			cairo_surface_t *recording = cairo_surface_reference(entry->recording);
+			if (pages->workers != NULL && pages->workers->recordings[page->num] == NULL) {
+				pages->workers->recordings[page->num] = recording;
+				if (pages->recording_sizes != NULL) {
+					memory_add(pages->memory, pages->recording_sizes[page->num]);
+				}
+			} else {
+				page_pool_set_recording(pages->pool, page->num, recording);
+			}
+			redrawn++;
+		}
+	}
+
+	free(memo.depths);
+	free(memo.hashes);
+
+	message("Reused the trim of %d of %d pages and the drawing of %d\n", reused, pages->npages, redrawn);
+	return hashes;
+}
+
+// keeps the ink extents of the pages of this run for the next one, and the
+// recordings the page pool kept or the previous run had of the same pages
+void update_trim_cache(struct trim_cache_t *cache, struct pages_t *pages, uint64_t *hashes) {
+	struct trim_cache_t previous = *cache;
+	int size = 16;
+	while (size < pages->npages * 2) {
+		size *= 2;
+	}
+	cache->entries = calloc(size, sizeof(struct trim_cache_entry_t));
+	cache->size = size;
+
+	int page_num;
+	for (page_num = 0; page_num < pages->npages; page_num++) {
+		struct page_t *page = &pages->pages[page_num];
+		if (!page->has_ink_extents || hashes[page->num] == 0) {
+			continue;
+		}
+		struct trim_cache_entry_t *entry = trim_cache_find(cache, hashes[page->num]);
+		if (entry->hash != 0) {
+			// a page repeated in the document
+			continue;
+		}
+		entry->hash = hashes[page->num];
+		entry->ink_extents = page->ink_extents;
+
+		cairo_surface_t *recording = pages->pool->entries[page->num].recording;
+		if (recording == NULL && previous.size > 0) {
+			recording = trim_cache_find(&previous, hashes[page->num])->recording;
+		}
+		entry->recording = recording != NULL ? cairo_surface_reference(recording) : NULL;
+	}
+
+	trim_cache_clear(&previous);
+}
+
+#ifdef __linux__
+// the watch is set up before the first run, so changes made while a book is
+// made are queued and end the next wait right away
+struct watcher_t* watcher_new(char *filename) {
+	struct watcher_t *watcher = malloc(sizeof(struct watcher_t));
+	watcher->filename = filename;
+	char *directory_copy = strdup(filename);
+	char *name_copy = strdup(filename);
+	watcher->name = strdup(basename(name_copy));
+	char *directory = dirname(directory_copy);
+
+	watcher->fd = inotify_init1(IN_CLOEXEC);
+	if (watcher->fd == -1 || inotify_add_watch(watcher->fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		fail("Could not watch %s: %s", directory, strerror(errno));
+	}
+
+	free(directory_copy);
+	free(name_copy);
+	return watcher;
+}
+
+// returns once the input was written and closed, or replaced by a rename,
+// since the previous wait
+void wait_for_change(struct watcher_t *watcher) {
+	// editors write in several steps, wait until they are done
+	int changed = FALSE;
+	struct pollfd pollfd = {watcher->fd, POLLIN, 0};
+	for (;;) {
+		int ready = poll(&pollfd, 1, changed ? WATCH_QUIET : -1);
+		if (ready == 0) {
+			break;
+		}
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ready == -1) {
+			fail("Could not watch %s: %s", watcher->filename, strerror(errno));
+		}
+
+		char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t length = read(watcher->fd, events, sizeof(events));
+		if (length == -1 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			fail("Could not watch %s: %s", watcher->filename, strerror(errno));
+		}
+
+		char *event_data = events;
+		while (event_data < events + length) {
+			struct inotify_event *event = (struct inotify_event*) event_data;
+			if (event->len > 0 && strcmp(event->name, watcher->name) == 0) {
+				changed = TRUE;
+			}
+			event_data += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+void watcher_free(struct watcher_t *watcher) {
+	close(watcher->fd);
+	free(watcher->name);
+	free(watcher);
+}
+#else
+// the input is compared with how it was before the first run, so changes
+// made while a book is made end the next wait right away
+struct watcher_t* watcher_new(char *filename) {
+	struct watcher_t *watcher = malloc(sizeof(struct watcher_t));
+	watcher->filename = filename;
+	if (stat(filename, &watcher->last) == -1) {
+		fail("Could not watch %s: %s", filename, strerror(errno));
+	}
+	return watcher;
+}
+
+void wait_for_change(struct watcher_t *watcher) {
+	// quiet once the modification time stops changing
+	int changed = FALSE;
+	for (;;) {
+		struct stat now;
+		if (stat(watcher->filename, &now) == -1) {
+			usleep(WATCH_QUIET * 1000);
+			continue;
+		}
+		if (now.st_mtime != watcher->last.st_mtime || now.st_size != watcher->last.st_size
+				|| now.st_ino != watcher->last.st_ino) {
+			changed = TRUE;
+			watcher->last = now;
+		} else if (changed) {
+			return;
+		}
+		usleep(WATCH_QUIET * 1000);
+	}
+}
+
+void watcher_free(struct watcher_t *watcher) {
+	free(watcher);
+}
+#endif
@@ -0,0 +1,326 @@
+#include "all.h"
+
+// method: with --threads, every thread draws pages with a poppler document,
+// page pool and pdf reader of its own, because none of them can be shared
+// between threads. The pages are scheduled by a cheap estimate of how long
+// they take to draw. Trimming draws every page to find its ink extents.
+// Laying out records the pages of a few sheets at a time in parallel and the
+// main thread places the recordings on the output in order while the threads
+// record the next sheets.
+
+#define SHEETS_PER_WORKER 2 // recorded ahead of the layout
+
+struct worker_t {
+	struct pages_t pages; // with a page pool of its own, sharing the page array
+	PopplerDocument *document;
+	struct workers_t *workers;
+	struct pages_t *shared;
+};
+
+// adds up the sizes of the content streams and forms of page num and the
+// pixels of its images, leaving them 0 if the page can not be read
+void page_size(struct pdf_file_t *pdf, int num, double *content, double *pixels) {
+	*content = 0;
+	*pixels = 0;
+	struct pdf_value_t *page = pdf != NULL ? pdf_page(pdf, num) : NULL;
+	if (page == NULL) {
+		return;
+	}
+
+	struct pdf_value_t *contents = pdf_dict_resolve(pdf, page, "Contents");
+	if (contents != NULL && contents->type == pdf_stream) {
+		*content += contents->stream_length;
+	} else if (contents != NULL && contents->type == pdf_array) {
+		int i;
+		for (i = 0; i < contents->length; i++) {
+			struct pdf_value_t *stream = pdf_resolve(pdf, contents->items[i]);
+			if (stream != NULL && stream->type == pdf_stream) {
+				*content += stream->stream_length;
+			}
+		}
+	}
+
+	struct pdf_value_t *resources = pdf_page_attribute(pdf, page, "Resources");
+	struct pdf_value_t *xobjects = pdf_dict_resolve(pdf, resources, "XObject");
+	if (xobjects != NULL && xobjects->type == pdf_dict) {
+		int i;
+		for (i = 0; i < xobjects->length; i++) {
+			struct pdf_value_t *xobject = pdf_resolve(pdf, xobjects->items[i]);
+			if (xobject == NULL || xobject->type != pdf_stream) {
+				continue;
+			}
+			if (pdf_is_name(pdf_dict_get(xobject, "Subtype"), "Image")) {
+				*pixels += (double) pdf_integer(pdf, pdf_dict_get(xobject, "Width"), 0)
+					* pdf_integer(pdf, pdf_dict_get(xobject, "Height"), 0);
+			} else {
+				*content += xobject->stream_length;
+			}
+		}
+	}
+}
+
+// a guess of how long drawing page num takes
+double page_cost(struct pdf_file_t *pdf, int num) {
+	double content, pixels;
+	page_size(pdf, num, &content, &pixels);
+	return 1 + content + pixels / 16;
+}
+
+void start_workers(struct pages_t *pages, struct options_t options) {
+	// every thread holds a recording of the page it draws and a document
+	int n = memory_threads(pages->memory, pages->largest_recording + document_memory(pages), options.threads);
+	if (n < 2) {
+		return;
+	}
+
+	struct workers_t *workers = malloc(sizeof(struct workers_t));
+	workers->n = n;
+	workers->workers = malloc(sizeof(struct worker_t)*workers->n);
+	workers->recordings = calloc(pages->npages, sizeof(cairo_surface_t*));
+	workers->record_tasks = malloc(sizeof(int)*SHEETS_PER_WORKER*n*4);
+	workers->record_costs = malloc(sizeof(double)*SHEETS_PER_WORKER*n*4);
+	pthread_mutex_init(&workers->lock, NULL);
+	workers->done = 0;
+
+	workers->costs = malloc(sizeof(double)*pages->npages);
+	int num;
+	for (num = 0; num < pages->npages; num++) {
+		workers->costs[num] = page_cost(pages->pdf, num);
+	}
+
+	void **contexts = malloc(sizeof(void*)*workers->n);
+	int i;
+	for (i = 0; i < workers->n; i++) {
+		struct worker_t *worker = &workers->workers[i];
+		worker->document = open_input_document(options);
+		worker_pages(&worker->pages, pages, worker->document);
+		worker->workers = workers;
+		worker->shared = pages;
+		contexts[i] = worker;
+	}
+	workers->scheduler = scheduler_new(workers->n, contexts);
+	// fonts are written once for every thread that draws with them
+	workers->scheduler->steal = !options.deterministic;
+
+	pages->workers = workers;
+}
+
+void stop_workers(struct pages_t *pages) {
+	struct workers_t *workers = pages->workers;
+	if (workers == NULL) {
+		return;
+	}
+
+	// a failed layout may leave the threads recording the next sheets
+	free(workers->scheduler->contexts);
+	scheduler_free(workers->scheduler);
+
+	int i;
+	for (i = 0; i < workers->n; i++) {
+		struct worker_t *worker = &workers->workers[i];
+		worker_pages_finish(&worker->pages, pages);
+		g_object_unref(worker->document);
+	}
+	// recordings are made for the layout, which places every one of them
+	for (i = 0; i < pages->pool->npages; i++) {
+		cairo_surface_t *recording = take_recording(pages, i);
+		if (recording != NULL) {
+			cairo_surface_destroy(recording);
+		}
+	}
+
+	pthread_mutex_destroy(&workers->lock);
+	free(workers->record_costs);
+	free(workers->record_tasks);
+	free(workers->recordings);
+	free(workers->costs);
+	free(workers->workers);
+	free(workers);
+	pages->workers = NULL;
+}
+
+void trim_task(void *context, int page_num) {
+	struct worker_t *worker = context;
+	page_ink_extents(&worker->pages, &worker->pages.pages[page_num]);
+
+	pthread_mutex_lock(&worker->workers->lock);
+	worker->workers->done++;
+	progress_update(&worker->shared->progress, worker->workers->done);
+	pthread_mutex_unlock(&worker->workers->lock);
+}
+
+// finds the ink extents of all pages in parallel, so the trim functions
+// find them already known
+void trim_in_parallel(struct pages_t *pages) {
+	struct workers_t *workers = pages->workers;
+
+	int *tasks = malloc(sizeof(int)*pages->npages);
+	double *costs = malloc(sizeof(double)*pages->npages);
+	int ntasks = 0;
+	int page_num;
+	for (page_num = 0; page_num < pages->npages; page_num++) {
+		if (!pages->pages[page_num].has_ink_extents) {
+			tasks[ntasks] = page_num;
+			costs[ntasks] = workers->costs[pages->pages[page_num].num];
+			ntasks++;
+		}
+	}
+
+	workers->done = 0;
+	progress_start(&pages->progress, "trim", "pages", ntasks);
+	scheduler_run(workers->scheduler, trim_task, tasks, costs, ntasks);
+	progress_finish(&pages->progress);
+
+	print_scheduler_stats(workers->scheduler, "Trim");
+	reset_scheduler_stats(workers->scheduler);
+
+	free(costs);
+	free(tasks);
+}
+
+void record_task(void *context, int num) {
+	struct worker_t *worker = context;
+
+	if (worker->pages.color != color_keep) {
+		cairo_surface_t *converted = color_page_recording(&worker->pages, num);
+		if (converted != NULL) {
+			worker->workers->recordings[num] = converted;
+			if (worker->pages.recording_sizes != NULL) {
+				memory_add(worker->pages.memory, worker->pages.recording_sizes[num]);
+			}
+			return;
+		}
+	}
+
+	// scanned pages are passed through by the main thread without drawing
+	if (can_pass_through(&worker->pages, num)) {
+		return;
+	}
+
+	struct page_pool_t *pool = worker->pages.pool;
+	cairo_surface_t *recording = cairo_surface_reference(page_pool_get_recording(pool, num));
+	page_pool_drop_recording(pool, num);
+	worker->workers->recordings[num] = recording;
+	if (pool->recording_sizes != NULL) {
+		memory_add(pool->memory, pool->recording_sizes[num]);
+	}
+}
+
+// returns TRUE if document page num is on one of nsheets sheets starting at
+// first_sheet
+int on_sheets(struct pages_t *pages, struct options_t options, int first_sheet, int nsheets, int num) {
+	int num_pages_to_layout = get_num_pages_to_layout(pages->npages);
+	int page_to_layout;
+	for (page_to_layout = first_sheet*4; page_to_layout < (first_sheet + nsheets)*4; page_to_layout++) {
+		int page_num = layout_page_num(page_to_layout, num_pages_to_layout, options);
+		if (page_num < pages->npages && pages->pages[page_num].num == num) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// starts recording the pages of nsheets sheets starting at first_sheet in
+// parallel, leaving out pages of the laid_out_count sheets starting at
+// laid_out_first, which the main thread places meanwhile
+// draw_page places the recordings instead of drawing the pages again
+void start_recording_sheets(struct pages_t *pages, struct options_t options, int first_sheet, int nsheets,
+	int laid_out_first, int laid_out_count) {
+	struct workers_t *workers = pages->workers;
+	int num_pages_to_layout = get_num_pages_to_layout(pages->npages);
+
+	int ntasks = 0;
+	int page_to_layout;
+	for (page_to_layout = first_sheet*4; page_to_layout < (first_sheet + nsheets)*4; page_to_layout++) {
+		int page_num = layout_page_num(page_to_layout, num_pages_to_layout, options);
+		if (page_num >= pages->npages) {
+			continue;
+		}
+		int num = pages->pages[page_num].num;
+		if (num >= pages->pool->npages || workers->recordings[num] != NULL
+			|| on_sheets(pages, options, laid_out_first, laid_out_count, num)) {
+			continue;
+		}
+		workers->record_tasks[ntasks] = num;
+		workers->record_costs[ntasks] = workers->costs[num];
+		ntasks++;
+	}
+
+	scheduler_start(workers->scheduler, record_task, workers->record_tasks, workers->record_costs, ntasks);
+}
+
+// estimated bytes of the recordings of the pages on a sheet
+size_t sheet_memory(struct pages_t *pages, struct options_t options, int sheet) {
+	if (pages->recording_sizes == NULL) {
+		return 0;
+	}
+
+	int num_pages_to_layout = get_num_pages_to_layout(pages->npages);
+	size_t size = 0;
+	int page_to_layout;
+	for (page_to_layout = sheet*4; page_to_layout < (sheet + 1)*4; page_to_layout++) {
+		int page_num = layout_page_num(page_to_layout, num_pages_to_layout, options);
+		if (page_num < pages->npages && pages->pages[page_num].num < pages->pool->npages) {
+			size += pages->recording_sizes[pages->pages[page_num].num];
+		}
+	}
+	return size;
+}
+
+// returns how many sheets from first_sheet to record at once: at least one,
+// more as long as they fit the budget
+int sheets_to_record(struct pages_t *pages, struct options_t options, int first_sheet, int nsheets) {
+	int batch = SHEETS_PER_WORKER * pages->workers->n;
+	size_t available = memory_available(pages->memory);
+	size_t size = 0;
+	int count;
+	for (count = 0; count < batch && first_sheet + count < nsheets; count++) {
+		size += sheet_memory(pages, options, first_sheet + count);
+		if (count > 0 && size > available) {
+			break;
+		}
+	}
+	return count;
+}
+
+// lays out all sheets, recording the pages of a few sheets per thread at a
+// time, the next sheets while the main thread places the ones recorded before
+void layout_in_parallel(cairo_surface_t* surface, cairo_t *cr, struct pages_t *pages, struct options_t options) {
+	struct workers_t *workers = pages->workers;
+	int nsheets = get_num_pages_to_layout(pages->npages)/4;
+
+	int first_sheet = 0;
+	int count = sheets_to_record(pages, options, 0, nsheets);
+	start_recording_sheets(pages, options, 0, count, 0, 0);
+	scheduler_wait(workers->scheduler);
+	while (first_sheet < nsheets) {
+		int next_sheet = first_sheet + count;
+		int next_count = 0;
+		if (next_sheet < nsheets) {
+			next_count = sheets_to_record(pages, options, next_sheet, nsheets);
+			start_recording_sheets(pages, options, next_sheet, next_count, first_sheet, count);
+		}
+		layout_sheets(surface, cr, pages, options, first_sheet, count);
+		if (next_count > 0) {
+			scheduler_wait(workers->scheduler);
+		}
+		first_sheet = next_sheet;
+		count = next_count;
+	}
+
+	print_scheduler_stats(workers->scheduler, "Layout");
+	reset_scheduler_stats(workers->scheduler);
+}
+
+// takes the recording of page num made for the layout, NULL if there is none
+cairo_surface_t* take_recording(struct pages_t *pages, int num) {
+	if (pages->workers == NULL) {
+		return NULL;
+	}
+	cairo_surface_t *recording = pages->workers->recordings[num];
+	pages->workers->recordings[num] = NULL;
+	if (recording != NULL && pages->recording_sizes != NULL) {
+		memory_release(pages->memory, pages->recording_sizes[num]);
+	}
+	return recording;
+}
@@ -0,0 +1,144 @@
+#include "all.h"
+
+// method: cairo hands the output to the write function while it lays out
+// the book, so the layout waits for every write. A writer copies the output
+// into a ring of large buffers and a thread of its own passes the full ones
+// to the write function, in order. The layout only waits when all buffers
+// are full. The time spent waiting is measured either way, so the two can be
+// compared.
+
+struct writer_t* writer_new(bookmaker_write_func_t write, void *closure, int nbuffers, size_t size) {
+	struct writer_t *writer = malloc(sizeof(struct writer_t));
+	writer->write = write;
+	writer->closure = closure;
+	writer->nbuffers = nbuffers;
+	writer->size = size;
+	writer->buffers = malloc(sizeof(struct buffer_t)*nbuffers);
+	int i;
+	for (i = 0; i < nbuffers; i++) {
+		writer->buffers[i].data = malloc(size);
+		writer->buffers[i].length = 0;
+		writer->buffers[i].allocated = size;
+	}
+	writer->head = 0;
+	writer->count = 0;
+	writer->done = FALSE;
+	writer->error = FALSE;
+	writer->blocked = 0;
+	writer->busy = 0;
+	writer->bytes = 0;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->changed, NULL);
+
+	if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+		fail("could not start a thread for writing the output");
+	}
+	return writer;
+}
+
+void* writer_thread(void *data) {
+	struct writer_t *writer = data;
+
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		while (writer->count == 0 && !writer->done) {
+			pthread_cond_wait(&writer->changed, &writer->lock);
+		}
+		if (writer->count == 0) {
+			break;
+		}
+
+		// the buffer at head is not touched by the layout until it is given back
+		struct buffer_t *buffer = &writer->buffers[writer->head];
+		int error = writer->error;
+		pthread_mutex_unlock(&writer->lock);
+
+		double start = progress_now();
+		size_t written = 0;
+		while (!error && written < buffer->length) {
+			unsigned int chunk = buffer->length - written > G_MAXUINT ? G_MAXUINT : buffer->length - written;
+			error = writer->write(writer->closure, (unsigned char*) buffer->data + written, chunk) != 0;
+			written += chunk;
+		}
+		buffer->length = 0;
+
+		pthread_mutex_lock(&writer->lock);
+		writer->busy += progress_now() - start;
+		writer->error = error;
+		writer->head = (writer->head + 1) % writer->nbuffers;
+		writer->count--;
+		pthread_cond_signal(&writer->changed);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+// hands the buffer being filled to the thread and waits for a free one
+void writer_flush(struct writer_t *writer) {
+	double start = progress_now();
+	pthread_mutex_lock(&writer->lock);
+	writer->count++;
+	pthread_cond_signal(&writer->changed);
+	while (writer->count == writer->nbuffers) {
+		pthread_cond_wait(&writer->changed, &writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	writer->blocked += progress_now() - start;
+}
+
+// returns 0 if data will be written, like a bookmaker_write_func_t
+int writer_write(struct writer_t *writer, const unsigned char *data, unsigned int length) {
+	writer->bytes += length;
+	while (length > 0) {
+		// the layout owns the buffer after the ones waiting for the thread
+		pthread_mutex_lock(&writer->lock);
+		struct buffer_t *buffer = &writer->buffers[(writer->head + writer->count) % writer->nbuffers];
+		int error = writer->error;
+		pthread_mutex_unlock(&writer->lock);
+		if (error) {
+			return 1;
+		}
+
+		size_t chunk = writer->size - buffer->length;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(buffer->data + buffer->length, data, chunk);
+		buffer->length += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (buffer->length == writer->size) {
+			writer_flush(writer);
+		}
+	}
+	return 0;
+}
+
+// writes what is left and stops the thread
+// returns 0 if everything was written
+int writer_finish(struct writer_t *writer) {
+	double start = progress_now();
+	pthread_mutex_lock(&writer->lock);
+	if (writer->buffers[(writer->head + writer->count) % writer->nbuffers].length > 0) {
+		writer->count++;
+	}
+	writer->done = TRUE;
+	pthread_cond_signal(&writer->changed);
+	pthread_mutex_unlock(&writer->lock);
+
+	pthread_join(writer->thread, NULL);
+	writer->blocked += progress_now() - start;
+	return writer->error;
+}
+
+void writer_free(struct writer_t *writer) {
+	int i;
+	for (i = 0; i < writer->nbuffers; i++) {
+		free(writer->buffers[i].data);
+	}
+	free(writer->buffers);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->changed);
+	free(writer);
+}